@@ -21,6 +21,9 @@
 #include "protocol.hpp"
 
 #include "textchannel.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 
 #if TP_QT_VERSION < TP_QT_VERSION_CHECK(0, 9, 8)
 #include "contactgroups.hpp"
@@ -48,19 +51,25 @@
 
 #include <QStandardPaths>
 
-#define DIALOGS_AS_CONTACTLIST
-//#define BROADCAST_AS_CONTACT
-
 #include <QDir>
 #include <QFile>
+#include <QTimer>
+
+#include <algorithm>
 
 #include "extras/CFileManager.hpp"
+#include "historysync.hpp"
 
 static constexpr int c_selfHandle = 1;
 static const QString c_telegramAccountSubdir = QLatin1String("telepathy/morse");
 static const QString c_accountFile = QLatin1String("account.bin");
-static const QString c_stateFile = QLatin1String("state.json");
+static const QString c_stateFile = QLatin1String("state.bin");
+static const QString c_avatarsSubdir = QLatin1String("avatars");
+static const QString c_mediaSubdir = QLatin1String("media");
 
+static const int c_presenceUpdateInterval = 500; // ms
+
+static const QString c_avatarMimeType = QLatin1String("image/jpeg");
 static const QString c_onlineSimpleStatusKey = QLatin1String("available");
 static const QString c_saslMechanismTelepathyPassword = QLatin1String("X-TELEPATHY-PASSWORD");
 
@@ -137,12 +146,24 @@ Tp::RequestableChannelClassSpecList MorseConnection::getRequestableChannelList()
 MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QString &cmName, const QString &protocolName, const QVariantMap &parameters) :
     Tp::BaseConnection(dbusConnection, cmName, protocolName, parameters)
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     m_selfPhone = MorseProtocol::getAccount(parameters);
     m_serverAddress = MorseProtocol::getServerAddress(parameters);
     m_serverPort = MorseProtocol::getServerPort(parameters);
     m_serverKeyFile = MorseProtocol::getServerKey(parameters);
     m_keepAliveInterval = MorseProtocol::getKeepAliveInterval(parameters, Client::Settings::defaultPingInterval() / 1000);
+    m_dialogsAsContactList = MorseProtocol::getDialogsAsContactList(parameters);
+    m_broadcastAsContact = MorseProtocol::getBroadcastAsContact(parameters);
+
+    m_presenceUpdateTimer = new QTimer(this);
+    m_presenceUpdateTimer->setSingleShot(true);
+    m_presenceUpdateTimer->setInterval(c_presenceUpdateInterval);
+    connect(m_presenceUpdateTimer, &QTimer::timeout, this, &MorseConnection::publishPendingPresences);
+
+    m_messageDeliveryTimer = new QTimer(this);
+    m_messageDeliveryTimer->setSingleShot(true);
+    m_messageDeliveryTimer->setInterval(MorseProtocol::getMessageBatchInterval(parameters));
+    connect(m_messageDeliveryTimer, &QTimer::timeout, this, &MorseConnection::deliverPendingMessages);
 
     /* Connection.Interface.Contacts */
     contactsIface = Tp::BaseConnectionContactsInterface::create();
@@ -153,9 +174,7 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING,
-                                                 #if 0
                                                      TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS,
-                                                 #endif
                                                  });
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(contactsIface));
 
@@ -198,14 +217,12 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
     aliasingIface->setGetAliasesCallback(Tp::memFun(this, &MorseConnection::getAliases));
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(aliasingIface));
 
-#if 0
     /* Connection.Interface.Avatars */
     avatarsIface = Tp::BaseConnectionAvatarsInterface::create();
     avatarsIface->setAvatarDetails(avatarDetails());
     avatarsIface->setGetKnownAvatarTokensCallback(Tp::memFun(this, &MorseConnection::getKnownAvatarTokens));
     avatarsIface->setRequestAvatarsCallback(Tp::memFun(this, &MorseConnection::requestAvatars));
     plugInterface(Tp::AbstractConnectionInterfacePtr::dynamicCast(avatarsIface));
-#endif
 
 #ifdef ENABLE_GROUP_CHAT
 # ifdef USE_BUNDLED_GROUPS_IFACE
@@ -229,7 +246,7 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
 
     connect(this, &BaseConnection::disconnected, this, &MorseConnection::onDisconnected);
 
-    m_contactHandles.insert(c_selfHandle, Telegram::Peer());
+    m_contactHandles.setPeer(c_selfHandle, Telegram::Peer());
     setSelfHandle(c_selfHandle);
 
     m_appInfo = new Client::AppInformation(this);
@@ -247,6 +264,13 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
     accountStorage->setAccountIdentifier(m_selfPhone);
     accountStorage->setFileName(getAccountDataDirectory() + QLatin1Char('/') + c_accountFile);
 
+    m_stateStorage.setFileName(getAccountDataDirectory() + QLatin1Char('/') + c_stateFile);
+    m_stateStorage.load();
+
+    m_avatarCache.setDirectory(getAccountDataDirectory() + QLatin1Char('/') + c_avatarsSubdir);
+    m_avatarCache.setMaximumSize(MorseProtocol::getAvatarCacheSize(parameters));
+    m_avatarCache.load();
+
     Client::Settings *clientSettings = new Client::Settings(m_client);
     m_dataStorage = new Client::InMemoryDataStorage(m_client);
     m_client->setSettings(clientSettings);
@@ -255,11 +279,11 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
 
     if (!m_serverAddress.isEmpty()) {
         if ((m_serverPort == 0) || (m_serverKeyFile.isEmpty())) {
-            qCritical() << "Invalid server configuration!";
+            qCCritical(lcMorseConnection) << "Invalid server configuration!";
         }
         RsaKey key = RsaKey::fromFile(m_serverKeyFile);
         if (!key.isValid()) {
-            qCritical() << "Unable to read server key!";
+            qCCritical(lcMorseConnection) << "Unable to read server key!";
         }
         DcOption customServer;
         customServer.address = m_serverAddress;
@@ -275,10 +299,18 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
             this, &MorseConnection::onConnectionStatusChanged);
     connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageReceived,
              this, &MorseConnection::onNewMessageReceived);
+    connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageActionChanged,
+            this, &MorseConnection::onMessageActionChanged);
+    connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageSent,
+            this, &MorseConnection::onMessageSent);
+    connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageReadInbox,
+            this, &MorseConnection::onMessageReadInbox);
+    connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageReadOutbox,
+            this, &MorseConnection::onMessageReadOutbox);
 //    connect(m_core, &CTelegramCore::chatChanged,
 //            this, &MorseConnection::whenChatChanged);
-//    connect(m_core, &CTelegramCore::contactStatusChanged,
-//            this, &MorseConnection::setContactStatus);
+    connect(m_client->contactsApi(), &Telegram::Client::ContactsApi::contactStatusChanged,
+            this, &MorseConnection::onContactStatusChanged);
 
     const QString proxyType = MorseProtocol::getProxyType(parameters);
     if (!proxyType.isEmpty()) {
@@ -288,9 +320,9 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
             const QString proxyUsername = MorseProtocol::getProxyUsername(parameters);
             const QString proxyPassword = MorseProtocol::getProxyPassword(parameters);
             if (proxyServer.isEmpty() || proxyPort == 0) {
-                qWarning() << "Invalid proxy configuration, ignored";
+                qCWarning(lcMorseConnection) << "Invalid proxy configuration, ignored";
             } else {
-                qDebug() << Q_FUNC_INFO << "Set proxy";
+                qCDebug(lcMorseConnection) << Q_FUNC_INFO << "Set proxy";
                 QNetworkProxy proxy;
                 proxy.setType(QNetworkProxy::Socks5Proxy);
                 proxy.setHostName(proxyServer);
@@ -300,11 +332,20 @@ MorseConnection::MorseConnection(const QDBusConnection &dbusConnection, const QS
                 clientSettings->setProxy(proxy);
             }
         } else {
-            qWarning() << "Unknown proxy type" << proxyType << ", ignored.";
+            qCWarning(lcMorseConnection) << "Unknown proxy type" << proxyType << ", ignored.";
         }
     }
     m_fileManager = new CFileManager(m_client, this);
+    m_fileManager->setCacheDirectory(getAccountDataDirectory() + QLatin1Char('/') + c_mediaSubdir);
+    m_mediaDownloadLimit = MorseProtocol::getMediaDownloadLimit(parameters);
+    m_mediaCache.setDirectory(getAccountDataDirectory() + QLatin1Char('/') + c_mediaSubdir);
+    m_mediaCache.setMaximumSize(MorseProtocol::getMediaCacheSize(parameters));
+    m_mediaCache.load();
     connect(m_fileManager, &CFileManager::requestComplete, this, &MorseConnection::onFileRequestCompleted);
+    connect(m_fileManager, &CFileManager::requestFailed, this, &MorseConnection::onFileRequestFailed);
+
+    m_historySync = new MorseHistorySync(m_client, this);
+    connect(m_historySync, &MorseHistorySync::messagesFetched, this, &MorseConnection::onHistoryMessagesFetched);
 }
 
 void MorseConnection::doConnect(Tp::DBusError *error)
@@ -342,12 +383,17 @@ void MorseConnection::signInOrUp()
 void MorseConnection::onConnectionStatusChanged(Client::ConnectionApi::Status status,
                                                 Client::ConnectionApi::StatusReason reason)
 {
-    qDebug() << Q_FUNC_INFO << status << reason;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << status << reason;
+    MorseMetrics::increment(MorseMetrics::ConnectionStatusChanges);
     switch (status) {
     case Client::ConnectionApi::StatusConnected:
         onAuthenticated();
         break;
     case Client::ConnectionApi::StatusReady:
+        if (m_wasReady) {
+            MorseMetrics::increment(MorseMetrics::Reconnects);
+        }
+        m_wasReady = true;
         onConnectionReady();
         updateSelfContactState(Tp::ConnectionStatusConnected);
         break;
@@ -369,7 +415,7 @@ void MorseConnection::onConnectionStatusChanged(Client::ConnectionApi::Status st
 
 void MorseConnection::onAuthenticated()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO;
 
     if (!saslIface_authCode.isNull()) {
         saslIface_authCode->setSaslStatus(Tp::SASLStatusSucceeded, QLatin1String("Succeeded"), QVariantMap());
@@ -384,21 +430,21 @@ void MorseConnection::onAuthenticated()
 
 void MorseConnection::onSelfUserAvailable()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO;
 
     const Telegram::Peer selfIdentifier = Telegram::Peer::fromUserId(m_client->contactsApi()->selfContactId());
     if (!selfIdentifier.isValid()) {
-        qCritical() << Q_FUNC_INFO << "Self id unexpectedly not available";
+        qCCritical(lcMorseConnection) << Q_FUNC_INFO << "Self id unexpectedly not available";
         return;
     }
 
-    m_contactHandles.insert(c_selfHandle, selfIdentifier);
+    m_contactHandles.setPeer(c_selfHandle, selfIdentifier);
     setSelfContact(c_selfHandle, selfIdentifier.toString());
 }
 
 void MorseConnection::onAuthCodeRequired()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO;
 
     Tp::DBusError error;
 
@@ -425,7 +471,7 @@ void MorseConnection::onAuthCodeRequired()
     baseChannel->registerObject(&error);
 
     if (error.isValid()) {
-        qDebug() << Q_FUNC_INFO << error.name() << error.message();
+        qCDebug(lcMorseAuth) << Q_FUNC_INFO << error.name() << error.message();
     } else {
         addChannel(baseChannel);
     }
@@ -453,7 +499,7 @@ void MorseConnection::onAuthErrorOccurred(TelegramNamespace::AuthenticationError
 
 void MorseConnection::onPasswordRequired()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO;
     Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, TP_QT_IFACE_CHANNEL_TYPE_SERVER_AUTHENTICATION);
     Tp::BaseChannelServerAuthenticationTypePtr authType
             = Tp::BaseChannelServerAuthenticationType::create(TP_QT_IFACE_CHANNEL_INTERFACE_SASL_AUTHENTICATION);
@@ -477,7 +523,7 @@ void MorseConnection::onPasswordRequired()
     baseChannel->registerObject(&error);
 
     if (error.isValid()) {
-        qDebug() << Q_FUNC_INFO << error.name() << error.message();
+        qCDebug(lcMorseAuth) << Q_FUNC_INFO << error.name() << error.message();
     } else {
         addChannel(baseChannel);
     }
@@ -495,12 +541,12 @@ void MorseConnection::onPasswordCheckFailed()
 
 void MorseConnection::onSignInFinished()
 {
-    qDebug() << Q_FUNC_INFO << m_signOperation->errorDetails();
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO << m_signOperation->errorDetails();
 }
 
 void MorseConnection::onCheckInFinished(Client::AuthOperation *checkInOperation)
 {
-    qDebug() << Q_FUNC_INFO << checkInOperation->errorDetails();
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO << checkInOperation->errorDetails();
     if (!checkInOperation->isSucceeded()) {
         signInOrUp();
     }
@@ -508,7 +554,7 @@ void MorseConnection::onCheckInFinished(Client::AuthOperation *checkInOperation)
 
 void MorseConnection::startMechanismWithData_authCode(const QString &mechanism, const QByteArray &data, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << mechanism << data;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO << mechanism << data;
     if (!saslIface_authCode->availableMechanisms().contains(mechanism)) {
         error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QString(QLatin1String("Given SASL mechanism \"%1\" is not implemented")).arg(mechanism));
         return;
@@ -520,7 +566,7 @@ void MorseConnection::startMechanismWithData_authCode(const QString &mechanism,
 
 void MorseConnection::startMechanismWithData_password(const QString &mechanism, const QByteArray &data, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << mechanism << data;
+    qCDebug(lcMorseAuth) << Q_FUNC_INFO << mechanism << data;
     if (!saslIface_password->availableMechanisms().contains(mechanism)) {
         error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QStringLiteral("Given SASL mechanism \"%1\" is not implemented").arg(mechanism));
         return;
@@ -532,34 +578,40 @@ void MorseConnection::startMechanismWithData_password(const QString &mechanism,
 
 void MorseConnection::onConnectionReady()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     //m_core->setOnlineStatus(m_wantedPresence == c_onlineSimpleStatusKey);
     //m_core->setMessageReceivingFilter(TelegramNamespace::MessageFlagNone);
 
-#ifdef DIALOGS_AS_CONTACTLIST
+    // The dialogs are needed to catch up the missed messages even if the roster is built from the contacts
     if (m_dialogs) {
         onDialogsReady();
     } else {
         m_dialogs = m_client->messagingApi()->getDialogList();
         connect(m_dialogs->becomeReady(), &PendingOperation::finished, this, &MorseConnection::onDialogsReady);
     }
-#else
-    if (m_contacts) {
-        onContactListChanged();
-    } else {
-        m_contacts = m_client->contactsApi()->getContactList();
-        connect(m_contacts->becomeReady(), &PendingOperation::finished, this, &MorseConnection::onContactListChanged);
+
+    if (!m_dialogsAsContactList) {
+        if (m_contacts) {
+            updateContactList();
+        } else {
+            m_contacts = m_client->contactsApi()->getContactList();
+            connect(m_contacts->becomeReady(), &PendingOperation::finished, this, &MorseConnection::updateContactList);
+        }
     }
-#endif
 
     onSelfUserAvailable();
 
     setStatus(Tp::ConnectionStatusConnected, Tp::ConnectionStatusReasonRequested);
+
+    if (m_contactList.isEmpty()) {
+        // Show the roster known from the previous session until the actual one is received
+        loadCachedContactList();
+    }
 }
 
 QStringList MorseConnection::inspectHandles(uint handleType, const Tp::UIntList &handles, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << handleType << handles;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << handleType << handles;
 
     switch (handleType) {
     case Tp::HandleTypeContact:
@@ -573,18 +625,21 @@ QStringList MorseConnection::inspectHandles(uint handleType, const Tp::UIntList
     }
 
     QStringList result;
+    result.reserve(handles.count());
 
-    const QMap<uint, Telegram::Peer> handlesContainer = handleType == Tp::HandleTypeContact ? m_contactHandles : m_chatHandles;
+    const MorseHandleRegistry &handlesContainer = handleType == Tp::HandleTypeContact ? m_contactHandles : m_chatHandles;
 
-    foreach (uint handle, handles) {
-        if (!handlesContainer.contains(handle)) {
+    for (const uint handle : handles) {
+        // Implicitly shared, the identifier is not formatted again
+        const QString identifier = handlesContainer.identifier(handle);
+        if (identifier.isEmpty()) {
             if (error) {
                 error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Unknown handle"));
             }
             return QStringList();
         }
 
-        result.append(handlesContainer.value(handle).toString());
+        result.append(identifier);
     }
 
     return result;
@@ -592,6 +647,7 @@ QStringList MorseConnection::inspectHandles(uint handleType, const Tp::UIntList
 
 Tp::BaseChannelPtr MorseConnection::createChannelCB(const QVariantMap &request, Tp::DBusError *error)
 {
+    MORSE_TRACE_SCOPE("MorseConnection::createChannelCB");
     const QString channelType = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")).toString();
 
     if (channelType == TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST) {
@@ -606,19 +662,31 @@ Tp::BaseChannelPtr MorseConnection::createChannelCB(const QVariantMap &request,
     case Tp::HandleTypeContact:
         if (request.contains(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle"))) {
             targetHandle = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle")).toUInt();
-            targetID = m_contactHandles.value(targetHandle);
+            targetID = m_contactHandles.peer(targetHandle);
         } else if (request.contains(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID"))) {
-            targetID = Telegram::Peer::fromString(request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID")).toString());
-            targetHandle = ensureHandle(targetID);
+            const QString identifier = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID")).toString();
+            targetHandle = m_contactHandles.handle(identifier);
+            if (targetHandle) {
+                targetID = m_contactHandles.peer(targetHandle);
+            } else {
+                targetID = Telegram::Peer::fromString(identifier);
+                targetHandle = ensureHandle(targetID);
+            }
         }
         break;
     case Tp::HandleTypeRoom:
         if (request.contains(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle"))) {
             targetHandle = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle")).toUInt();
-            targetID = m_chatHandles.value(targetHandle);
+            targetID = m_chatHandles.peer(targetHandle);
         } else if (request.contains(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID"))) {
-            targetID = Telegram::Peer::fromString(request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID")).toString());
-            targetHandle = ensureHandle(targetID);
+            const QString identifier = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".TargetID")).toString();
+            targetHandle = m_chatHandles.handle(identifier);
+            if (targetHandle) {
+                targetID = m_chatHandles.peer(targetHandle);
+            } else {
+                targetID = Telegram::Peer::fromString(identifier);
+                targetHandle = ensureHandle(targetID);
+            }
         }
         break;
     default:
@@ -632,7 +700,7 @@ Tp::BaseChannelPtr MorseConnection::createChannelCB(const QVariantMap &request,
         initiatorHandle = request.value(TP_QT_IFACE_CHANNEL + QLatin1String(".InitiatorHandle"), selfHandle()).toUInt();
     }
 
-    qDebug() << "MorseConnection::createChannel " << channelType
+    qCDebug(lcMorseConnection) << "MorseConnection::createChannel " << channelType
              << targetHandleType
              << targetHandle
              << request;
@@ -661,19 +729,14 @@ Tp::BaseChannelPtr MorseConnection::createChannelCB(const QVariantMap &request,
     }
 
     Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, channelType, Tp::HandleType(targetHandleType), targetHandle);
-    baseChannel->setTargetID(targetID.toString());
+    const MorseHandleRegistry &targetHandles = targetHandleType == Tp::HandleTypeContact ? m_contactHandles : m_chatHandles;
+    baseChannel->setTargetID(targetHandles.identifier(targetHandle));
     baseChannel->setInitiatorHandle(initiatorHandle);
 
     if (channelType == TP_QT_IFACE_CHANNEL_TYPE_TEXT) {
         MorseTextChannelPtr textChannel = MorseTextChannel::create(this, baseChannel.data());
         baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(textChannel));
-
-        if (targetHandleType == Tp::HandleTypeRoom) {
-            connect(this, &MorseConnection::chatDetailsChanged,
-                    textChannel.data(), &MorseTextChannel::onChatDetailsChanged);
-
-            // onChatChanged(targetID.id);
-        }
+        m_textChannels.insert(MorseHandleRegistry::peerKey(targetID), textChannel.data());
     }
 
     return baseChannel;
@@ -681,7 +744,7 @@ Tp::BaseChannelPtr MorseConnection::createChannelCB(const QVariantMap &request,
 
 Tp::UIntList MorseConnection::requestHandles(uint handleType, const QStringList &identifiers, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << identifiers;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << identifiers;
 
     if (handleType != Tp::HandleTypeContact) {
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("MorseConnection::requestHandles - Handle Type unknown"));
@@ -689,7 +752,13 @@ Tp::UIntList MorseConnection::requestHandles(uint handleType, const QStringList
     }
 
     Tp::UIntList result;
+    result.reserve(identifiers.count());
     for(const QString &identify : identifiers) {
+        const uint knownHandle = m_contactHandles.handle(identify);
+        if (knownHandle) {
+            result.append(knownHandle);
+            continue;
+        }
         const Telegram::Peer id = Telegram::Peer::fromString(identify);
         if (!id.isValid()) {
             error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("MorseConnection::requestHandles - invalid identifier"));
@@ -709,39 +778,73 @@ Tp::ContactAttributesMap MorseConnection::getContactListAttributes(const QString
 Tp::ContactAttributesMap MorseConnection::getContactAttributes(const Tp::UIntList &handles, const QStringList &interfaces, Tp::DBusError *error)
 {
 //    http://telepathy.freedesktop.org/spec/Connection_Interface_Contacts.html#Method:GetContactAttributes
-//    qDebug() << Q_FUNC_INFO << handles << interfaces;
+//    qCDebug(lcMorseConnection) << Q_FUNC_INFO << handles << interfaces;
+
+    static const QString contactIdKey = TP_QT_IFACE_CONNECTION + QLatin1String("/contact-id");
+    static const QString subscribeKey = TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe");
+    static const QString publishKey = TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish");
+    static const QString presenceKey = TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE + QLatin1String("/presence");
+    static const QString aliasKey = TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING + QLatin1String("/alias");
+    static const QString avatarTokenKey = TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token");
+    static const QString infoKey = TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO + QLatin1String("/info");
+
+    // Resolve the requested interfaces once, not per contact
+    const bool wantContactList = interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST);
+    const bool wantPresence = interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE);
+    const bool wantAlias = interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING);
+    const bool wantAvatar = interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS);
+    const bool wantInfo = interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO);
+
+    Tp::SimpleContactPresences presences;
+    if (wantPresence) {
+        presences = simplePresenceIface->getPresences(handles);
+    }
 
     Tp::ContactAttributesMap contactAttributes;
 
     foreach (const uint handle, handles) {
         if (m_contactHandles.contains(handle)) {
             QVariantMap attributes;
-            const Telegram::Peer identifier = m_contactHandles.value(handle);
+            const Telegram::Peer identifier = m_contactHandles.peer(handle);
             if (!identifier.isValid()) {
-                qWarning() << Q_FUNC_INFO << "Handle is in map, but identifier is not valid";
+                qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Handle is in map, but identifier is not valid";
                 continue;
             }
-            attributes[TP_QT_IFACE_CONNECTION + QLatin1String("/contact-id")] = identifier.toString();
+            attributes[contactIdKey] = m_contactHandles.identifier(handle);
 
-            if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST)) {
-                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/subscribe")] = m_contactsSubscription.value(handle, Tp::SubscriptionStateUnknown);
-                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST + QLatin1String("/publish")] = m_contactsSubscription.value(handle, Tp::SubscriptionStateUnknown);
+            if (wantContactList) {
+                const uint subscriptionState = m_contactsSubscription.value(handle, Tp::SubscriptionStateUnknown);
+                attributes[subscribeKey] = subscriptionState;
+                attributes[publishKey] = subscriptionState;
             }
 
-            if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE)) {
-                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE + QLatin1String("/presence")] = QVariant::fromValue(getPresence(handle));
+            if (wantPresence) {
+                attributes[presenceKey] = QVariant::fromValue(presences.value(handle));
             }
 
-            if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING)) {
-                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING + QLatin1String("/alias")] = QVariant::fromValue(getAlias(identifier));
-            }
-
-            //if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS)) {
-            //    attributes[TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS + QLatin1String("/token")] = QVariant::fromValue(m_core->peerPictureToken(identifier));
-            //}
-
-            if (interfaces.contains(TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO)) {
-                attributes[TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO + QLatin1String("/info")] = QVariant::fromValue(getUserInfo(identifier.id));
+            if (wantAlias || wantAvatar || wantInfo) {
+                CachedContactAttributes &cached = m_contactAttributesCache[handle];
+                if (wantAlias) {
+                    if (!(cached.resolved & CachedContactAttributes::Alias)) {
+                        cached.alias = getAlias(identifier);
+                        cached.resolved |= CachedContactAttributes::Alias;
+                    }
+                    attributes[aliasKey] = QVariant::fromValue(cached.alias);
+                }
+                if (wantAvatar) {
+                    if (!(cached.resolved & CachedContactAttributes::AvatarToken)) {
+                        cached.avatarToken = getAvatarToken(identifier);
+                        cached.resolved |= CachedContactAttributes::AvatarToken;
+                    }
+                    attributes[avatarTokenKey] = QVariant::fromValue(cached.avatarToken);
+                }
+                if (wantInfo) {
+                    if (!(cached.resolved & CachedContactAttributes::Info)) {
+                        cached.info = getUserInfo(identifier.id);
+                        cached.resolved |= CachedContactAttributes::Info;
+                    }
+                    attributes[infoKey] = QVariant::fromValue(cached.info);
+                }
             }
 
             contactAttributes[handle] = attributes;
@@ -768,7 +871,7 @@ void MorseConnection::removeContacts(const Tp::UIntList &handles, Tp::DBusError
             return;
         }
 
-        quint32 userId = m_contactHandles.value(handle).id;
+        quint32 userId = m_contactHandles.peer(handle).id;
 
         if (!userId) {
             error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Internal error (invalid handle)"));
@@ -782,13 +885,13 @@ void MorseConnection::removeContacts(const Tp::UIntList &handles, Tp::DBusError
 
 Tp::ContactInfoFieldList MorseConnection::requestContactInfo(uint handle, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << handle;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << handle;
 
     if (!m_contactHandles.contains(handle)) {
         error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Invalid handle"));
         return Tp::ContactInfoFieldList();
     }
-    Telegram::Peer identifier = m_contactHandles.value(handle);
+    Telegram::Peer identifier = m_contactHandles.peer(handle);
     if (!identifier.isValid()) {
         error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Invalid morse identifier"));
         return Tp::ContactInfoFieldList();
@@ -848,7 +951,7 @@ Tp::ContactInfoFieldList MorseConnection::getUserInfo(const quint32 userId) cons
 
 Tp::ContactInfoMap MorseConnection::getContactInfo(const Tp::UIntList &contacts, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << contacts;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << contacts;
 
     if (contacts.isEmpty()) {
         return Tp::ContactInfoMap();
@@ -868,7 +971,7 @@ Tp::ContactInfoMap MorseConnection::getContactInfo(const Tp::UIntList &contacts,
 
 Tp::AliasMap MorseConnection::getAliases(const Tp::UIntList &handles, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << handles;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << handles;
 
     Tp::AliasMap aliases;
 
@@ -879,9 +982,48 @@ Tp::AliasMap MorseConnection::getAliases(const Tp::UIntList &handles, Tp::DBusEr
     return aliases;
 }
 
+/**
+ * Recompute the cached attributes of the \a handles (after the user infos
+ * are updated) and notify the clients about the changed aliases and avatars.
+ */
+void MorseConnection::refreshContactAttributes(const QVector<uint> &handles)
+{
+    Tp::AliasPairList changedAliases;
+    for (const uint handle : handles) {
+        QHash<uint, CachedContactAttributes>::iterator it = m_contactAttributesCache.find(handle);
+        if (it == m_contactAttributesCache.end()) {
+            continue;
+        }
+        const Telegram::Peer identifier = m_contactHandles.peer(handle);
+        CachedContactAttributes &cached = it.value();
+        if (cached.resolved & CachedContactAttributes::Alias) {
+            const QString alias = getAlias(identifier);
+            if (alias != cached.alias) {
+                cached.alias = alias;
+                changedAliases.append(Tp::AliasPair(handle, alias));
+            }
+        }
+        if (cached.resolved & CachedContactAttributes::AvatarToken) {
+            const QString avatarToken = getAvatarToken(identifier);
+            if (avatarToken != cached.avatarToken) {
+                cached.avatarToken = avatarToken;
+                avatarsIface->avatarUpdated(handle, avatarToken);
+                MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+            }
+        }
+        // Resolved again on demand
+        cached.resolved &= ~CachedContactAttributes::Info;
+    }
+
+    if (!changedAliases.isEmpty()) {
+        aliasingIface->aliasesChanged(changedAliases);
+        MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+    }
+}
+
 QString MorseConnection::getContactAlias(uint handle)
 {
-    return getAlias(m_contactHandles.value(handle));
+    return getAlias(m_contactHandles.peer(handle));
 }
 
 QString MorseConnection::getAlias(const Telegram::Peer identifier)
@@ -907,7 +1049,8 @@ QString MorseConnection::getAlias(const Telegram::Peer identifier)
         }
     }
 
-    return QString();
+    // The peer is not received from the server yet, use the alias from the previous session
+    return m_stateStorage.alias(identifier);
 }
 
 Tp::SimplePresence MorseConnection::getPresence(uint handle)
@@ -921,7 +1064,7 @@ Tp::SimplePresence MorseConnection::getPresence(uint handle)
 
 uint MorseConnection::setPresence(const QString &status, const QString &message, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << status;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << status;
     Q_UNUSED(message)
     Q_UNUSED(error)
 
@@ -950,6 +1093,9 @@ uint MorseConnection::ensureContact(quint32 userId)
 
 uint MorseConnection::ensureContact(const Telegram::Peer &identifier)
 {
+    if (!identifier.isValid()) {
+        return 0;
+    }
     uint handle = getContactHandle(identifier);
     if (!handle) {
         handle = addContacts( {identifier});
@@ -959,16 +1105,9 @@ uint MorseConnection::ensureContact(const Telegram::Peer &identifier)
 
 uint MorseConnection::ensureChat(const Telegram::Peer &identifier)
 {
-    uint handle = getChatHandle(identifier);
-    if (!handle) {
-        if (m_chatHandles.isEmpty()) {
-            handle = 1;
-        } else {
-            handle = m_chatHandles.keys().last() + 1;
-        }
-
-        m_chatHandles.insert(handle, identifier);
-    }
+    const uint lastHandle = m_chatHandles.lastHandle();
+    const uint handle = m_chatHandles.ensureHandle(identifier);
+    MorseMetrics::increment(MorseMetrics::HandlesAllocated, m_chatHandles.lastHandle() - lastHandle);
     return handle;
 }
 
@@ -979,33 +1118,19 @@ uint MorseConnection::ensureChat(const Telegram::Peer &identifier)
  */
 uint MorseConnection::addContacts(const QVector<Telegram::Peer> &identifiers)
 {
-    qDebug() << Q_FUNC_INFO;
-    uint handle = 0;
-
-    if (!m_contactHandles.isEmpty()) {
-        handle = m_contactHandles.keys().last();
-    }
-
-    QList<uint> newHandles;
-    QVector<Telegram::Peer> newIdentifiers;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
+    const uint lastHandle = m_contactHandles.lastHandle();
     for (const Telegram::Peer &identifier : identifiers) {
-        if (getContactHandle(identifier)) {
-            continue;
-        }
-
-        ++handle;
-        m_contactHandles.insert(handle, identifier);
-        newHandles << handle;
-        newIdentifiers << identifier;
+        m_contactHandles.ensureHandle(identifier);
     }
+    MorseMetrics::increment(MorseMetrics::HandlesAllocated, m_contactHandles.lastHandle() - lastHandle);
 
-    return handle;
+    return m_contactHandles.lastHandle();
 }
 
 void MorseConnection::updateContactsPresence(const QVector<Telegram::Peer> &identifiers)
 {
-    qDebug() << Q_FUNC_INFO;
-    Tp::SimpleContactPresences newPresences;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     for (const Telegram::Peer &identifier : identifiers) {
         uint handle = ensureContact(identifier);
 
@@ -1013,39 +1138,86 @@ void MorseConnection::updateContactsPresence(const QVector<Telegram::Peer> &iden
             continue;
         }
 
-        TelegramNamespace::ContactStatus st = TelegramNamespace::ContactStatusOnline;
+        // We list broadcast channels as Contacts, they are always available
+        TelegramNamespace::ContactStatus status = TelegramNamespace::ContactStatusOnline;
 
-        if (m_client) {
-            // We list broadcast channels as Contacts
-            if (identifier.type == Telegram::Peer::User) {
-                Telegram::UserInfo info;
-                m_client->dataStorage()->getUserInfo(&info, identifier.id);
-                st = info.status();
-            }
+        if (identifier.type == Telegram::Peer::User) {
+            Telegram::UserInfo info;
+            m_client->dataStorage()->getUserInfo(&info, identifier.id);
+            status = info.status();
         }
 
-        Tp::SimplePresence presence;
-
-        switch (st) {
-        case TelegramNamespace::ContactStatusOnline:
-            presence.status = QLatin1String("available");
-            presence.type = Tp::ConnectionPresenceTypeAvailable;
-            break;
-        case TelegramNamespace::ContactStatusOffline:
-            presence.status = QLatin1String("offline");
-            presence.type = Tp::ConnectionPresenceTypeOffline;
-            break;
-        case TelegramNamespace::ContactStatusUnknown:
-            presence.status = QLatin1String("unknown");
-            presence.type = Tp::ConnectionPresenceTypeUnknown;
-            break;
-        }
+        queueContactPresence(handle, getContactPresence(status));
+    }
+}
+
+void MorseConnection::onContactStatusChanged(quint32 userId, TelegramNamespace::ContactStatus status)
+{
+    const uint handle = getContactHandle(Telegram::Peer::fromUserId(userId));
+    if (!handle || (handle == selfHandle())) {
+        return;
+    }
+
+    // The status updates come along with the user info updates
+    refreshContactAttributes({handle});
+    queueContactPresence(handle, getContactPresence(status));
+}
+
+Tp::SimplePresence MorseConnection::getContactPresence(TelegramNamespace::ContactStatus status)
+{
+    Tp::SimplePresence presence;
 
+    switch (status) {
+    case TelegramNamespace::ContactStatusOnline:
         presence.status = QLatin1String("available");
         presence.type = Tp::ConnectionPresenceTypeAvailable;
-        newPresences[handle] = presence;
+        break;
+    case TelegramNamespace::ContactStatusOffline:
+        presence.status = QLatin1String("offline");
+        presence.type = Tp::ConnectionPresenceTypeOffline;
+        break;
+    case TelegramNamespace::ContactStatusUnknown:
+        presence.status = QLatin1String("unknown");
+        presence.type = Tp::ConnectionPresenceTypeUnknown;
+        break;
     }
-    simplePresenceIface->setPresences(newPresences);
+
+    return presence;
+}
+
+/* Presences are published in batches, see publishPendingPresences() */
+void MorseConnection::queueContactPresence(uint handle, const Tp::SimplePresence &presence)
+{
+    const QHash<uint, Tp::SimplePresence>::const_iterator published = m_contactPresences.constFind(handle);
+    if ((published != m_contactPresences.constEnd())
+            && (published->type == presence.type)
+            && (published->status == presence.status)
+            && (published->statusMessage == presence.statusMessage)) {
+        // Back to the published state within the same window
+        m_pendingPresences.remove(handle);
+        return;
+    }
+
+    m_pendingPresences.insert(handle, presence);
+    if (!m_presenceUpdateTimer->isActive()) {
+        m_presenceUpdateTimer->start();
+    }
+}
+
+void MorseConnection::publishPendingPresences()
+{
+    if (m_pendingPresences.isEmpty()) {
+        return;
+    }
+
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << "changed presences:" << m_pendingPresences.count();
+    for (Tp::SimpleContactPresences::const_iterator it = m_pendingPresences.constBegin(); it != m_pendingPresences.constEnd(); ++it) {
+        m_contactPresences.insert(it.key(), it.value());
+    }
+    MORSE_TRACE_SCOPE("MorseConnection::setPresences");
+    simplePresenceIface->setPresences(m_pendingPresences);
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+    m_pendingPresences.clear();
 }
 
 void MorseConnection::updateSelfContactState(Tp::ConnectionStatus status)
@@ -1062,11 +1234,12 @@ void MorseConnection::updateSelfContactState(Tp::ConnectionStatus status)
 
     newPresences[selfHandle()] = presence;
     simplePresenceIface->setPresences(newPresences);
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
 }
 
 void MorseConnection::setSubscriptionState(const QVector<Telegram::Peer> &identifiers, const QVector<uint> &handles, uint state)
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     if (identifiers.isEmpty()) {
         return;
     }
@@ -1079,61 +1252,210 @@ void MorseConnection::setSubscriptionState(const QVector<Telegram::Peer> &identi
         change.publishRequest = QString();
         change.subscribe = state;
         changes[handles[i]] = change;
-        identifiersMap[handles[i]] = identifiers[i].toString();
+        identifiersMap[handles[i]] = m_contactHandles.identifier(handles[i]);
         m_contactsSubscription[handles[i]] = state;
     }
     Tp::HandleIdentifierMap removals;
     contactListIface->contactsChangedWithID(changes, identifiersMap, removals);
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+    MorseMetrics::increment(MorseMetrics::ContactsChangedSignals);
 }
 
 /* Receive message from outside (telegram server) */
 void MorseConnection::onNewMessageReceived(const Peer peer, quint32 messageId)
 {
-    addMessages(peer, {messageId});
+    // Messages usually come in bursts (e.g. on reconnection), so collect them
+    // and deliver per peer on the next event loop iteration (or after the batch interval)
+    const quint64 key = MorseHandleRegistry::peerKey(peer);
+    QVector<quint32> &peerMessages = m_pendingMessages[key];
+    if (m_pendingMessagePeers.isEmpty()) {
+        m_pendingMessagesAge.start();
+    }
+    if (peerMessages.isEmpty()) {
+        m_pendingMessagePeers.append(peer);
+    }
+    peerMessages.append(messageId);
+
+    if (!m_messageDeliveryTimer->isActive()) {
+        m_messageDeliveryTimer->start();
+    }
+}
+
+void MorseConnection::deliverPendingMessages()
+{
+    const QVector<Telegram::Peer> peers = m_pendingMessagePeers;
+    QHash<quint64, QVector<quint32>> messages;
+    messages.swap(m_pendingMessages);
+    m_pendingMessagePeers.clear();
+
+    for (const Telegram::Peer &peer : peers) {
+        const quint64 key = MorseHandleRegistry::peerKey(peer);
+        const QVector<quint32> messageIds = messages.value(key);
+        if (m_historySync->isSyncing(peer)) {
+            // Keep the server order: the missed history goes first
+            QVector<quint32> &heldMessages = m_heldMessages[key];
+            if (heldMessages.isEmpty()) {
+                m_heldMessagePeers.append(peer);
+            }
+            heldMessages += messageIds;
+            continue;
+        }
+        addMessages(peer, messageIds);
+        MorseMetrics::increment(MorseMetrics::MessageBatchesDelivered);
+        MorseMetrics::increment(MorseMetrics::BatchedMessagesDelivered, messageIds.count());
+    }
+
+    if (!peers.isEmpty()) {
+        MorseMetrics::addSample(MorseMetrics::MessageDeliveryLatency, m_pendingMessagesAge.nsecsElapsed() / 1000);
+    }
+}
+
+void MorseConnection::onHistoryMessagesFetched(const Peer peer, const QVector<quint32> &messageIds)
+{
+    const quint64 key = MorseHandleRegistry::peerKey(peer);
+    QVector<quint32> allIds = messageIds;
+    if (m_heldMessages.contains(key)) {
+        m_heldMessagePeers.removeOne(peer);
+        allIds += m_heldMessages.take(key);
+        // A message can arrive live while its page is being fetched
+        std::sort(allIds.begin(), allIds.end());
+        allIds.erase(std::unique(allIds.begin(), allIds.end()), allIds.end());
+    }
+    addMessages(peer, allIds);
+}
+
+/* Deliver the held messages of the dialogs which are not synced anymore (e.g. the sync is stopped) */
+void MorseConnection::releaseHeldMessages()
+{
+    const QVector<Telegram::Peer> peers = m_heldMessagePeers;
+    for (const Telegram::Peer &peer : peers) {
+        if (!m_historySync->isSyncing(peer)) {
+            m_heldMessagePeers.removeOne(peer);
+            addMessages(peer, m_heldMessages.take(MorseHandleRegistry::peerKey(peer)));
+        }
+    }
 }
 
 void MorseConnection::addMessages(const Peer peer, const QVector<quint32> &messageIds)
 {
     bool groupChatMessage = peerIsRoom(peer);
 
+#ifndef ENABLE_GROUP_CHAT
     if (groupChatMessage) {
         return;
     }
+#endif
 
-    uint targetHandle = ensureHandle(peer);
-
-    QVector<quint32> newIds = messageIds;
+    const QVector<quint32> newIds = messageIds;
     if (newIds.isEmpty()) {
         return;
     }
 
-    //TODO: initiator should be group creator
-    Tp::DBusError error;
-    bool yours;
+    MorseMetrics::ScopedTimer timer(MorseMetrics::MessageIngestionTime);
+    MORSE_TRACE_SCOPE("MorseConnection::addMessages");
+    MorseMetrics::increment(MorseMetrics::MessagesReceived, newIds.count());
+
+    MorseTextChannel *textChannel = getTextChannel(peer);
+    if (!textChannel) {
+        uint targetHandle = ensureHandle(peer);
+
+        //TODO: initiator should be group creator
+        Tp::DBusError error;
+        bool yours;
+
+        QVariantMap request;
+        request[TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")] = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
+        request[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle")] = targetHandle;
+        request[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType")] = groupChatMessage ? Tp::HandleTypeRoom : Tp::HandleTypeContact;
+        Tp::BaseChannelPtr channel;
+        {
+            MORSE_TRACE_SCOPE("MorseConnection::ensureChannel");
+            channel = ensureChannel(request, yours, /* suppressHandler */ false, &error);
+        }
 
-    QVariantMap request;
-    request[TP_QT_IFACE_CHANNEL + QLatin1String(".ChannelType")] = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
-    request[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandle")] = targetHandle;
-    request[TP_QT_IFACE_CHANNEL + QLatin1String(".TargetHandleType")] = groupChatMessage ? Tp::HandleTypeRoom : Tp::HandleTypeContact;
-    Tp::BaseChannelPtr channel = ensureChannel(request, yours, /* suppressHandler */ false, &error);
+        if (error.isValid()) {
+            qCWarning(lcMorseConnection) << Q_FUNC_INFO << "ensureChannel failed:" << error.name() << " " << error.message();
+            return;
+        }
 
-    if (error.isValid()) {
-        qWarning() << Q_FUNC_INFO << "ensureChannel failed:" << error.name() << " " << error.message();
-        return;
+        textChannel = MorseTextChannelPtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_TYPE_TEXT)).data();
+
+        if (!textChannel) {
+            qCCritical(lcMorseConnection) << Q_FUNC_INFO << "Error, channel is not a morseTextChannel?";
+            return;
+        }
     }
 
-    MorseTextChannelPtr textChannel = MorseTextChannelPtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_TYPE_TEXT));
+    QVector<Telegram::Message> messages;
+    messages.reserve(newIds.count());
+    {
+        MORSE_TRACE_SCOPE("DataStorage::getMessage");
+        for (const quint32 messageId : newIds) {
+            Telegram::Message message;
+            m_client->dataStorage()->getMessage(&message, peer, messageId);
+            messages.append(message);
+        }
+    }
+    // The user infos of the senders are updated along with the messages
+    QVector<uint> senderHandles;
+    for (const Telegram::Message &message : messages) {
+        const uint senderHandle = getContactHandle(Telegram::Peer::fromUserId(message.fromId));
+        if (senderHandle && !senderHandles.contains(senderHandle)) {
+            senderHandles.append(senderHandle);
+        }
+    }
+    refreshContactAttributes(senderHandles);
 
-    if (!textChannel) {
-        qCritical() << Q_FUNC_INFO << "Error, channel is not a morseTextChannel?";
-        return;
+    quint32 &deliveredMaxId = m_deliveredMessageMaxIds[MorseHandleRegistry::peerKey(peer)];
+    deliveredMaxId = qMax(deliveredMaxId, *std::max_element(newIds.constBegin(), newIds.constEnd()));
+    textChannel->addMessages(messages);
+}
+
+void MorseConnection::onMessageActionChanged(const Peer &peer, quint32 userId, TelegramNamespace::MessageAction action)
+{
+    MorseTextChannel *channel = getTextChannel(peer);
+    if (channel) {
+        channel->setMessageAction(userId, action);
+    }
+}
+
+void MorseConnection::onMessageSent(const Peer &peer, quint64 messageRandomId, quint32 messageId)
+{
+    MorseTextChannel *channel = getTextChannel(peer);
+    if (channel) {
+        channel->setResolvedMessageId(messageRandomId, messageId);
+    }
+}
+
+void MorseConnection::onMessageReadInbox(const Peer &peer, quint32 messageId)
+{
+    MorseTextChannel *channel = getTextChannel(peer);
+    if (channel) {
+        channel->setMessageInboxRead(messageId);
+    }
+}
+
+void MorseConnection::onMessageReadOutbox(const Peer &peer, quint32 messageId)
+{
+    MorseTextChannel *channel = getTextChannel(peer);
+    if (channel) {
+        channel->setMessageOutboxRead(messageId);
     }
+}
 
-    for (const quint32 messageId : newIds) {
-        Telegram::Message message;
-        m_client->dataStorage()->getMessage(&message, peer, messageId);
-        textChannel->onMessageReceived(message);
+MorseTextChannel *MorseConnection::getTextChannel(const Peer &peer)
+{
+    const quint64 key = MorseHandleRegistry::peerKey(peer);
+    QHash<quint64, QPointer<MorseTextChannel>>::iterator it = m_textChannels.find(key);
+    if (it == m_textChannels.end()) {
+        return nullptr;
     }
+    if (!it.value()) {
+        // The channel is closed
+        m_textChannels.erase(it);
+        return nullptr;
+    }
+    return it.value().data();
 }
 
 void MorseConnection::updateContactList()
@@ -1141,18 +1463,31 @@ void MorseConnection::updateContactList()
     if (m_client->connectionApi()->status() != Client::ConnectionApi::StatusReady) {
         return;
     }
-#ifdef DIALOGS_AS_CONTACTLIST
-    const QVector<Telegram::Peer> ids = m_dialogs->peers();
-#else
-    const QVector<Telegram::Peer> ids = m_contacts->peers();
-#endif
+    processContactList(m_dialogsAsContactList ? m_dialogs->peers() : m_contacts->peers());
+}
+
+/* Builds the roster from the dialog or contact list peers (the rooms and deleted users are skipped) */
+void MorseConnection::processContactList(const QVector<Telegram::Peer> &ids)
+{
+    MorseMetrics::ScopedTimer timer(MorseMetrics::ContactListUpdateTime);
+    MORSE_TRACE_SCOPE("MorseConnection::updateContactList");
+    MorseMetrics::increment(MorseMetrics::ContactListUpdates);
+
+    // The chat and user infos are (re)loaded along with the roster.
+    // There is no chat info update signal, so this is the point where a chat
+    // that became (or stopped being) a broadcast is reclassified.
+    m_roomPeers.clear();
+    refreshContactAttributes(m_contactAttributesCache.keys().toVector());
+    for (const QPointer<MorseTextChannel> &channel : m_textChannels) {
+        if (channel) {
+            channel->refreshChatInfo();
+        }
+    }
 
-    qDebug() << this << __func__ << "ids:" << ids;
+    qCDebug(lcMorseConnection) << this << __func__ << "ids:" << ids.count();
 
-    QVector<uint> newContactListHandles;
-    QVector<Telegram::Peer> newContactListIdentifiers;
-    newContactListHandles.reserve(ids.count());
-    newContactListIdentifiers.reserve(ids.count());
+    QVector<Telegram::Peer> contactListIdentifiers;
+    contactListIdentifiers.reserve(ids.count());
 
     for (const Telegram::Peer &peer : ids) {
         if (peerIsRoom(peer)) {
@@ -1162,79 +1497,205 @@ void MorseConnection::updateContactList()
         if (peer.type == Telegram::Peer::User) {
             m_client->dataStorage()->getUserInfo(&info, peer.id);
             if (info.isDeleted()) {
-                qDebug() << this << __func__ << "skip deleted user id" << peer.id;
+                qCDebug(lcMorseConnection) << this << __func__ << "skip deleted user id" << peer.id;
                 continue;
             }
         }
-        newContactListIdentifiers.append(peer);
-        newContactListHandles.append(ensureContact(newContactListIdentifiers.last()));
+        contactListIdentifiers.append(peer);
     }
 
-    Tp::HandleIdentifierMap removals;
-    foreach (uint handle, m_contactList) {
-        if (newContactListHandles.contains(handle)) {
-            continue;
-        }
-        const Telegram::Peer identifier = m_contactHandles.value(handle);
-        if (!identifier.isValid()) {
-            qWarning() << this << __func__ << "Internal corruption. Handle" << handle << "has invalid corresponding identifier";
-        }
-        removals.insert(handle, identifier.toString());
+    setContactList(contactListIdentifiers);
+}
+
+void MorseConnection::loadCachedContactList()
+{
+    const QVector<Telegram::Peer> cachedIdentifiers = m_stateStorage.contactList();
+    if (cachedIdentifiers.isEmpty()) {
+        return;
     }
 
-    m_contactList = newContactListHandles;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << "contacts:" << cachedIdentifiers.count();
+    setContactList(cachedIdentifiers);
+}
+
+void MorseConnection::setContactList(const QVector<Telegram::Peer> &identifiers)
+{
+    QSet<uint> newContactList;
+    newContactList.reserve(identifiers.count());
 
-    qDebug() << this << __func__ << "new:" << newContactListIdentifiers;
-    qDebug() << this << __func__ << "removals:" << removals;
     Tp::ContactSubscriptionMap changes;
     Tp::HandleIdentifierMap identifiersMap;
+    int addedCount = 0;
+
+    for (const Telegram::Peer &peer : identifiers) {
+        const uint handle = ensureContact(peer);
+        if (newContactList.contains(handle)) {
+            continue;
+        }
+        newContactList.insert(handle);
+        m_stateStorage.setContact(peer, getAlias(peer));
+
+        const bool added = !m_contactList.contains(handle);
+        if (!added && (m_contactsSubscription.value(handle) == Tp::SubscriptionStateYes)) {
+            // Known contact, nothing changed
+            continue;
+        }
 
-    for (int i = 0; i < newContactListIdentifiers.size(); ++i) {
         Tp::ContactSubscriptions change;
         change.publish = Tp::SubscriptionStateYes;
         change.subscribe = Tp::SubscriptionStateYes;
-        changes[newContactListHandles[i]] = change;
-        identifiersMap[newContactListHandles[i]] = newContactListIdentifiers.at(i).toString();
-        m_contactsSubscription[newContactListHandles[i]] = Tp::SubscriptionStateYes;
+        changes.insert(handle, change);
+        identifiersMap.insert(handle, m_contactHandles.identifier(handle));
+        m_contactsSubscription[handle] = Tp::SubscriptionStateYes;
+
+        if (added) {
+            ++addedCount;
+        }
     }
 
-    contactListIface->contactsChangedWithID(changes, identifiersMap, removals);
+    Tp::HandleIdentifierMap removals;
+    for (const uint handle : m_contactList) {
+        if (newContactList.contains(handle)) {
+            continue;
+        }
+        const Telegram::Peer identifier = m_contactHandles.peer(handle);
+        if (!identifier.isValid()) {
+            qCWarning(lcMorseConnection) << this << __func__ << "Internal corruption. Handle" << handle << "has invalid corresponding identifier";
+        }
+        removals.insert(handle, m_contactHandles.identifier(handle));
+        m_contactsSubscription.remove(handle);
+        m_stateStorage.removeContact(identifier);
+    }
+
+    m_contactList = newContactList;
+    m_stateStorage.flush();
 
-    updateContactsPresence(newContactListIdentifiers);
+    qCDebug(lcMorseConnection) << this << __func__ << "added:" << addedCount
+             << "changed:" << changes.count() - addedCount
+             << "removed:" << removals.count();
 
-    contactListIface->setContactListState(Tp::ContactListStateSuccess);
+    if (!changes.isEmpty() || !removals.isEmpty()) {
+        contactListIface->contactsChangedWithID(changes, identifiersMap, removals);
+        MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+        MorseMetrics::increment(MorseMetrics::ContactsChangedSignals);
+    }
+    MorseMetrics::setGauge(MorseMetrics::ContactListSize, m_contactList.count());
+
+    // The presence of the known contacts may be stale too: the contacts loaded
+    // from the state storage have no user info until the real roster arrives.
+    // Unchanged presences are dropped by queueContactPresence().
+    updateContactsPresence(identifiers);
+
+    if (contactListIface->contactListState() != Tp::ContactListStateSuccess) {
+        contactListIface->setContactListState(Tp::ContactListStateSuccess);
+    }
 }
 
 void MorseConnection::onDialogsReady()
 {
-    updateContactList();
+    if (m_dialogsAsContactList) {
+        updateContactList();
+    }
+    startHistorySync();
+}
+
+void MorseConnection::startHistorySync()
+{
+    if (m_client->connectionApi()->status() != Client::ConnectionApi::StatusReady) {
+        return;
+    }
+    m_historySync->start(m_dialogs->peers(), m_deliveredMessageMaxIds);
+    releaseHeldMessages();
 }
 
 void MorseConnection::onDisconnected()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
+    for (const QString &requestId : m_peerPictureRequests.keys()) {
+        m_fileManager->cancelRequest(requestId);
+    }
+    m_peerPictureRequests.clear();
+    // The channels deliver the messages held for the media without the files
+    for (const QString &uniqueId : m_mediaRequestChannels.uniqueKeys()) {
+        m_fileManager->cancelRequest(uniqueId);
+        finishMediaRequest(uniqueId);
+    }
+    m_historySync->stop();
+    releaseHeldMessages();
+    m_presenceUpdateTimer->stop();
+    m_pendingPresences.clear();
+
     m_client->connectionApi()->disconnectFromServer();
 }
 
 void MorseConnection::onFileRequestCompleted(const QString &uniqueId)
 {
-    qDebug() << Q_FUNC_INFO << uniqueId;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << uniqueId;
+    const FileInfo *fileInfo = m_fileManager->getFileInfo(uniqueId);
+    if (!fileInfo) {
+        qCWarning(lcMorseConnection) << "MorseConnection::onFileRequestCompleted(): Unknown file id" << uniqueId;
+        m_peerPictureRequests.remove(uniqueId);
+        finishMediaRequest(uniqueId);
+        return;
+    }
+
     if (m_peerPictureRequests.contains(uniqueId)) {
-        const Telegram::Peer peer = m_peerPictureRequests.value(uniqueId);
+        const Telegram::Peer peer = m_peerPictureRequests.take(uniqueId);
         if (!peerIsRoom(peer)) {
-            const FileInfo *fileInfo = m_fileManager->getFileInfo(uniqueId);
-            avatarsIface->avatarRetrieved(peer.id, uniqueId, fileInfo->data(), fileInfo->mimeType());
+            avatarsIface->avatarRetrieved(ensureContact(peer), uniqueId, fileInfo->data(), fileInfo->mimeType());
+            MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+            if (m_avatarCache.insert(uniqueId, fileInfo->data())) {
+                // No need to keep the data in memory
+                m_fileManager->releaseFile(uniqueId);
+            }
         } else {
-            qWarning() << "MorseConnection::onFileRequestCompleted(): Ignore room picture";
+            qCWarning(lcMorseConnection) << "MorseConnection::onFileRequestCompleted(): Ignore room picture";
         }
+    } else if (fileInfo->isStreamed()) {
+        // The media file is on the disk now; it is requested again (and found there) on the message delivery
+        m_mediaCache.addFile(uniqueId);
+        m_fileManager->releaseFile(uniqueId);
+        finishMediaRequest(uniqueId);
     } else {
-        qWarning() << "MorseConnection::onFileRequestCompleted(): Unexpected file id";
+        qCWarning(lcMorseConnection) << "MorseConnection::onFileRequestCompleted(): Unexpected file id";
+    }
+}
+
+void MorseConnection::onFileRequestFailed(const QString &uniqueId)
+{
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << uniqueId;
+    m_peerPictureRequests.remove(uniqueId);
+    finishMediaRequest(uniqueId);
+}
+
+void MorseConnection::addMediaRequest(const QString &uniqueId, MorseTextChannel *channel)
+{
+    if (!m_mediaRequestChannels.contains(uniqueId, channel)) {
+        m_mediaRequestChannels.insert(uniqueId, channel);
+    }
+}
+
+void MorseConnection::removeMediaRequest(const QString &uniqueId, MorseTextChannel *channel)
+{
+    m_mediaRequestChannels.remove(uniqueId, channel);
+    if (!m_mediaRequestChannels.contains(uniqueId)) {
+        // Nobody else waits for the file
+        m_fileManager->cancelRequest(uniqueId);
+    }
+}
+
+void MorseConnection::finishMediaRequest(const QString &uniqueId)
+{
+    const QList<MorseTextChannel*> channels = m_mediaRequestChannels.values(uniqueId);
+    m_mediaRequestChannels.remove(uniqueId);
+    for (MorseTextChannel *channel : channels) {
+        channel->onMediaFileRequestFinished(uniqueId);
     }
 }
 
 void MorseConnection::onGotRooms()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     Tp::RoomInfoList rooms;
 
     const QVector<Telegram::Peer> dialogs = m_client->dataStorage()->dialogs();
@@ -1253,7 +1714,7 @@ void MorseConnection::onGotRooms()
         Tp::RoomInfo roomInfo;
         roomInfo.channelType = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
         roomInfo.handle = ensureChat(chatID);
-        roomInfo.info[QLatin1String("handle-name")] = chatID.toString();
+        roomInfo.info[QLatin1String("handle-name")] = m_chatHandles.identifier(roomInfo.handle);
         roomInfo.info[QLatin1String("members-only")] = true;
         roomInfo.info[QLatin1String("invite-only")] = true;
         roomInfo.info[QLatin1String("password")] = false;
@@ -1268,7 +1729,7 @@ void MorseConnection::onGotRooms()
 
 Tp::BaseChannelPtr MorseConnection::createRoomListChannel()
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     Tp::BaseChannelPtr baseChannel = Tp::BaseChannel::create(this, TP_QT_IFACE_CHANNEL_TYPE_ROOM_LIST);
 
     roomListChannel = Tp::BaseChannelRoomListType::create();
@@ -1279,6 +1740,16 @@ Tp::BaseChannelPtr MorseConnection::createRoomListChannel()
     return baseChannel;
 }
 
+QString MorseConnection::getAvatarToken(const Telegram::Peer &peer) const
+{
+    // The unique id changes along with the picture, so it is a perfect token
+    Telegram::RemoteFile pictureFile;
+    if (!m_fileManager->getPeerPictureFileInfo(peer, &pictureFile)) {
+        return QString();
+    }
+    return pictureFile.getUniqueId();
+}
+
 Tp::AvatarTokenMap MorseConnection::getKnownAvatarTokens(const Tp::UIntList &contacts, Tp::DBusError *error)
 {
     if (contacts.isEmpty()) {
@@ -1293,8 +1764,9 @@ Tp::AvatarTokenMap MorseConnection::getKnownAvatarTokens(const Tp::UIntList &con
     foreach (quint32 handle, contacts) {
         if (!m_contactHandles.contains(handle)) {
             error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Invalid handle(s)"));
+            continue;
         }
-        //result.insert(handle, m_core->peerPictureToken(m_handles.value(handle)));
+        result.insert(handle, getAvatarToken(m_contactHandles.peer(handle)));
     }
 
     return result;
@@ -1304,32 +1776,49 @@ void MorseConnection::requestAvatars(const Tp::UIntList &contacts, Tp::DBusError
 {
     if (contacts.isEmpty()) {
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("No handles provided"));
+        return;
     }
 
     if (status() != Tp::ConnectionStatusConnected) {
         error->set(TP_QT_ERROR_DISCONNECTED, QLatin1String("Disconnected"));
+        return;
     }
 
     foreach (quint32 handle, contacts) {
         if (!m_contactHandles.contains(handle)) {
             error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Invalid handle(s)"));
+            return;
         }
-        const Telegram::Peer peer = m_contactHandles.value(handle);
+        const Telegram::Peer peer = m_contactHandles.peer(handle);
         Telegram::RemoteFile pictureFile;
-        m_fileManager->getPeerPictureFileInfo(peer, &pictureFile);
+        if (!m_fileManager->getPeerPictureFileInfo(peer, &pictureFile)) {
+            // No picture
+            continue;
+        }
         const QString requestId = pictureFile.getUniqueId();
-        const FileInfo *fileInfo = m_fileManager->getFileInfo(requestId);
-        if (fileInfo && fileInfo->isComplete()) {
-            const QByteArray data = m_fileManager->getData(requestId);
+        if (m_avatarCache.contains(requestId)) {
+            const QByteArray data = m_avatarCache.data(requestId);
             if (!data.isEmpty()) {
                 // I don't see an easy way to delay the invocation; emit the signal synchronously for now. Should not be a problem for a good client.
-                avatarsIface->avatarRetrieved(handle, requestId, data, fileInfo->mimeType());
+                avatarsIface->avatarRetrieved(handle, requestId, data, c_avatarMimeType);
+                MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+                continue;
             }
+        }
+        const FileInfo *fileInfo = m_fileManager->getFileInfo(requestId);
+        if (fileInfo && fileInfo->isComplete()) {
+            // Downloaded, but not cached (e.g. exceeds the cache size)
+            avatarsIface->avatarRetrieved(handle, requestId, fileInfo->data(), fileInfo->mimeType());
+            MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
             continue;
         }
-        const QString newRequestId = m_fileManager->requestFile(pictureFile);
+        const QString newRequestId = m_fileManager->requestFile(pictureFile, CFileManager::PriorityHigh);
         if (newRequestId != requestId) {
-            qWarning() << "Unexpected request id!" << newRequestId << "(expected:" << requestId;
+            qCWarning(lcMorseConnection) << "Unexpected request id!" << newRequestId << "(expected:" << requestId;
+        }
+        if (!m_fileManager->getFileInfo(newRequestId)) {
+            // The picture is not available
+            continue;
         }
         m_peerPictureRequests.insert(newRequestId, peer);
     }
@@ -1363,25 +1852,33 @@ bool MorseConnection::peerIsRoom(const Telegram::Peer peer) const
     if (peer.type == Telegram::Peer::User) {
         return false;
     }
-#ifdef BROADCAST_AS_CONTACT
-    if (peer.type == Telegram::Peer::Channel) {
-        Telegram::ChatInfo info;
-        if (m_client->dataStorage()->getChatInfo(&info, peer)) {
-            if (info.broadcast()) {
-                return false;
-            }
-        }
+    if (!m_broadcastAsContact || (peer.type != Telegram::Peer::Channel)) {
+        return true;
     }
-#endif
-    return true;
+
+    const quint64 key = MorseHandleRegistry::peerKey(peer);
+    QHash<quint64, bool>::const_iterator it = m_roomPeers.constFind(key);
+    if (it != m_roomPeers.constEnd()) {
+        return it.value();
+    }
+
+    MORSE_TRACE_SCOPE("DataStorage::getChatInfo");
+    Telegram::ChatInfo info;
+    if (!m_client->dataStorage()->getChatInfo(&info, peer)) {
+        // Unknown yet, do not cache
+        return true;
+    }
+    const bool isRoom = !info.broadcast();
+    m_roomPeers.insert(key, isRoom);
+    return isRoom;
 }
 
 uint MorseConnection::getContactHandle(const Telegram::Peer &identifier) const
 {
-    return m_contactHandles.key(identifier, 0);
+    return m_contactHandles.handle(identifier);
 }
 
 uint MorseConnection::getChatHandle(const Telegram::Peer &identifier) const
 {
-    return m_chatHandles.key(identifier, 0);
+    return m_chatHandles.handle(identifier);
 }
@@ -28,7 +28,19 @@
 #include <TelegramQt/ConnectionApi>
 #include <TelegramQt/TelegramNamespace>
 
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QSet>
+
+#include "filecache.hpp"
+#include "handleregistry.hpp"
+#include "statestorage.hpp"
+
+class QTimer;
+
 class CFileManager;
+class MorseHistorySync;
+class MorseTextChannel;
 
 namespace Telegram {
 
@@ -48,6 +60,7 @@ class InMemoryDataStorage;
 class MorseConnection : public Tp::BaseConnection
 {
     Q_OBJECT
+    friend class MorseFakeClient; // Drives the connection in the benchmarks, see tests/fakeclient/
 public:
     MorseConnection(const QDBusConnection &dbusConnection,
             const QString &cmName, const QString &protocolName,
@@ -86,16 +99,21 @@ public:
     uint ensureContact(quint32 userId);
     uint ensureContact(const Telegram::Peer &identifier);
     uint ensureChat(const Telegram::Peer &identifier);
+    QString contactIdentifier(uint handle) const { return m_contactHandles.identifier(handle); }
 
     Telegram::Client::Client *core() const { return m_client; }
+    CFileManager *fileManager() const { return m_fileManager; }
+    quint32 mediaDownloadLimit() const { return m_mediaDownloadLimit; }
+    MorseFileCache *mediaCache() { return &m_mediaCache; }
+
+    /* The channels waiting for the media downloads, see MorseTextChannel::requestMediaFile() */
+    void addMediaRequest(const QString &uniqueId, MorseTextChannel *channel);
+    void removeMediaRequest(const QString &uniqueId, MorseTextChannel *channel);
 
 public slots:
     void onNewMessageReceived(const Telegram::Peer peer, quint32 messageId);
     void addMessages(const Telegram::Peer peer, const QVector<quint32> &messageIds);
 
-signals:
-    void chatDetailsChanged(quint32 chatId, const Tp::UIntList &handles);
-
 private slots:
     void onConnectionStatusChanged(Telegram::Client::ConnectionApi::Status status,
                                    Telegram::Client::ConnectionApi::StatusReason reason);
@@ -110,8 +128,18 @@ private slots:
     void onConnectionReady();
     void updateContactList();
     void onDialogsReady();
+    void startHistorySync();
     void onDisconnected();
     void onFileRequestCompleted(const QString &uniqueId);
+    void onFileRequestFailed(const QString &uniqueId);
+    void onMessageActionChanged(const Telegram::Peer &peer, quint32 userId, TelegramNamespace::MessageAction action);
+    void onMessageSent(const Telegram::Peer &peer, quint64 messageRandomId, quint32 messageId);
+    void onMessageReadInbox(const Telegram::Peer &peer, quint32 messageId);
+    void onMessageReadOutbox(const Telegram::Peer &peer, quint32 messageId);
+    void deliverPendingMessages();
+    void onHistoryMessagesFetched(const Telegram::Peer peer, const QVector<quint32> &messageIds);
+    void onContactStatusChanged(quint32 userId, TelegramNamespace::ContactStatus status);
+    void publishPendingPresences();
 
     /* Channel.Type.RoomList */
     void onGotRooms();
@@ -126,7 +154,19 @@ private:
     uint getChatHandle(const Telegram::Peer &identifier) const;
     uint addContacts(const QVector<Telegram::Peer> &identifiers);
 
+    MorseTextChannel *getTextChannel(const Telegram::Peer &peer);
+
+    void releaseHeldMessages();
+    void finishMediaRequest(const QString &uniqueId);
+
+    void processContactList(const QVector<Telegram::Peer> &ids);
+    void loadCachedContactList();
+    void setContactList(const QVector<Telegram::Peer> &identifiers);
+
     void updateContactsPresence(const QVector<Telegram::Peer> &identifiers);
+    void refreshContactAttributes(const QVector<uint> &handles);
+    static Tp::SimplePresence getContactPresence(TelegramNamespace::ContactStatus status);
+    void queueContactPresence(uint handle, const Tp::SimplePresence &presence);
     void updateSelfContactState(Tp::ConnectionStatus status);
     void setSubscriptionState(const QVector<Telegram::Peer> &identifiers, const QVector<uint> &handles, uint state);
 
@@ -134,6 +174,7 @@ private:
     void startMechanismWithData_password(const QString &mechanism, const QByteArray &data, Tp::DBusError *error);
 
     /* Connection.Interface.Avatars */
+    QString getAvatarToken(const Telegram::Peer &peer) const;
     Tp::AvatarTokenMap getKnownAvatarTokens(const Tp::UIntList &contacts, Tp::DBusError *error);
     void requestAvatars(const Tp::UIntList &contacts, Tp::DBusError *error);
 
@@ -157,13 +198,53 @@ private:
 
     QString m_wantedPresence;
 
-    QVector<quint32> m_contactList;
-    QMap<uint, Telegram::Peer> m_contactHandles;
-    QMap<uint, Telegram::Peer> m_chatHandles;
+    QSet<uint> m_contactList;
+    MorseHandleRegistry m_contactHandles;
+    MorseHandleRegistry m_chatHandles;
     /* Maps a contact handle to its subscription state */
     QHash<uint, uint> m_contactsSubscription;
+
+    /* The attributes derived from the user info, resolved on demand */
+    struct CachedContactAttributes {
+        enum Attribute {
+            Alias = 1 << 0,
+            AvatarToken = 1 << 1,
+            Info = 1 << 2,
+        };
+        QString alias;
+        QString avatarToken;
+        Tp::ContactInfoFieldList info;
+        uint resolved = 0;
+    };
+    QHash<uint, CachedContactAttributes> m_contactAttributesCache;
+    /* Maps a channel peer key to its classification (broadcasts can be shown as contacts) */
+    mutable QHash<quint64, bool> m_roomPeers;
     QHash<QString,Telegram::Peer> m_peerPictureRequests;
 
+    /* Open text channels, for the per-peer events dispatching */
+    QHash<quint64, QPointer<MorseTextChannel>> m_textChannels;
+
+    MorseStateStorage m_stateStorage;
+    MorseFileCache m_avatarCache;
+    MorseFileCache m_mediaCache;
+
+    /* Published contact presences and the changes waiting for the next batch */
+    QHash<uint, Tp::SimplePresence> m_contactPresences;
+    Tp::SimpleContactPresences m_pendingPresences;
+    QTimer *m_presenceUpdateTimer = nullptr;
+
+    /* Incoming messages waiting for the delivery, grouped by peer in order of arrival */
+    QVector<Telegram::Peer> m_pendingMessagePeers;
+    QHash<quint64, QVector<quint32>> m_pendingMessages;
+    QTimer *m_messageDeliveryTimer = nullptr;
+    QElapsedTimer m_pendingMessagesAge; // Since the oldest pending message arrival
+    QHash<quint64, quint32> m_deliveredMessageMaxIds; // Peer key to the newest delivered message id
+    /* Incoming messages of the dialogs being synced, delivered after the missed history */
+    QVector<Telegram::Peer> m_heldMessagePeers;
+    QHash<quint64, QVector<quint32>> m_heldMessages;
+
+    QMultiHash<QString, MorseTextChannel*> m_mediaRequestChannels; // File unique id to the waiting channels
+
     Telegram::Client::AppInformation *m_appInfo = nullptr;
     Telegram::Client::Client *m_client = nullptr;
     Telegram::Client::InMemoryDataStorage *m_dataStorage = nullptr;
@@ -171,6 +252,7 @@ private:
     Telegram::Client::DialogList *m_dialogs = nullptr;
     Telegram::Client::ContactList *m_contacts = nullptr;
     CFileManager *m_fileManager = nullptr;
+    MorseHistorySync *m_historySync = nullptr;
 
     int m_authReconnectionsCount = 0;
 
@@ -179,6 +261,10 @@ private:
     QString m_serverKeyFile;
     uint m_serverPort = 0;
     uint m_keepAliveInterval;
+    bool m_dialogsAsContactList = true;
+    bool m_broadcastAsContact = false;
+    bool m_wasReady = false; // To count reconnections
+    quint32 m_mediaDownloadLimit = 0;
 };
 
 #endif // MORSE_CONNECTION_HPP
@@ -18,9 +18,23 @@
 */
 
 #include "debug.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 
 #include <TelepathyQt/BaseDebug>
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+#include <QCoreApplication>
+#include <QDBusConnection>
+#include <QDebug>
+#include <QHash>
+#include <QLoggingCategory>
+#include <QMutex>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+#endif
+
 #if TP_QT_VERSION < TP_QT_VERSION_CHECK(0, 9, 8)
 class FixedBaseDebug : public Tp::BaseDebug
 {
@@ -49,76 +63,353 @@ static QPointer<Tp::BaseDebug> debugInterfacePtr;
 
 #if QT_VERSION < QT_VERSION_CHECK(5, 0, 0)
 bool enableDebugInterface() { return false; }
+void setDebugCategoryLevel(const QByteArray &category, QtMsgType minimumLevel)
+{
+    Q_UNUSED(category)
+    Q_UNUSED(minimumLevel)
+}
 #else
 
+static const QString c_loggingObjectPath = QString(TP_QT_DEBUG_OBJECT_PATH) + QLatin1String("/logging");
+
+/**
+ * Runtime log level control, exported next to the Telepathy debug object:
+ *
+ *   dbus-send --session --print-reply --dest=org.freedesktop.Telepathy.ConnectionManager.morse \
+ *       /org/freedesktop/Telepathy/debug/logging \
+ *       org.freedesktop.Telepathy.ConnectionManager.morse.Logging.SetCategoryLevel \
+ *       string:morse.connection string:debug
+ */
+class MorseLoggingControl : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.Telepathy.ConnectionManager.morse.Logging")
+public:
+    explicit MorseLoggingControl(QObject *parent) : QObject(parent) { }
+
+public slots:
+    Q_SCRIPTABLE bool SetCategoryLevel(const QString &category, const QString &level)
+    {
+        QtMsgType type;
+        if (level == QLatin1String("debug")) {
+            type = QtDebugMsg;
+        } else if (level == QLatin1String("info")) {
+            type = QtInfoMsg;
+        } else if (level == QLatin1String("warning")) {
+            type = QtWarningMsg;
+        } else if (level == QLatin1String("critical")) {
+            type = QtCriticalMsg;
+        } else {
+            return false;
+        }
+        setDebugCategoryLevel(category.toLatin1(), type);
+        return true;
+    }
+};
+
+static const QString c_metricsObjectPath = QString(TP_QT_DEBUG_OBJECT_PATH) + QLatin1String("/metrics");
+
+/**
+ * Read only access to MorseMetrics for local monitoring.
+ */
+class MorseMetricsExporter : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.Telepathy.ConnectionManager.morse.Metrics")
+public:
+    explicit MorseMetricsExporter(QObject *parent) : QObject(parent) { }
+
+public slots:
+    Q_SCRIPTABLE QString GetMetrics() const
+    {
+        return MorseMetrics::toText();
+    }
+};
+
+static const QString c_tracingObjectPath = QString(TP_QT_DEBUG_OBJECT_PATH) + QLatin1String("/tracing");
+
+/**
+ * Control of MorseTracing; GetTrace() returns the recorded spans in the
+ * Chrome trace event format.
+ */
+class MorseTracingControl : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.Telepathy.ConnectionManager.morse.Tracing")
+public:
+    explicit MorseTracingControl(QObject *parent) : QObject(parent) { }
+
+public slots:
+    Q_SCRIPTABLE void SetEnabled(bool enabled)
+    {
+        MorseTracing::setEnabled(enabled);
+    }
+
+    Q_SCRIPTABLE void Clear()
+    {
+        MorseTracing::clear();
+    }
+
+    Q_SCRIPTABLE QString GetTrace() const
+    {
+        return QString::fromLatin1(MorseTracing::toChromeTraceJson());
+    }
+};
+
 static QtMessageHandler defaultMessageHandler = 0;
+static QLoggingCategory::CategoryFilter defaultCategoryFilter = 0;
 
-void debugViaDBusInterface(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+// Do not keep the whole session log in memory
+static const int c_debugMessagesLimit = 2000;
+// Messages queued between two event loop iterations; the oldest are dropped on overflow
+static const int c_debugQueueCapacity = 1024;
+
+struct DebugEntry
 {
-    if (!debugInterfacePtr.isNull()) {
-        QString domain(QLatin1String("%1:%2, %3"));
-        QByteArray fileName = QByteArray::fromRawData(context.file, qstrlen(context.file));
-
-        static const char *namesToWrap[] = {
-            "morse",
-            "telepathy-qt"
-        };
-
-        for (int i = 0; i < 2; ++i) {
-            int index = fileName.indexOf(namesToWrap[i]);
-            if (index < 0) {
-                continue;
-            }
-
-            fileName = fileName.mid(index);
-            break;
+    QtMsgType type;
+    int line;
+    // Interned copies of the context strings, see internString()
+    const char *file;
+    const char *function;
+    const char *category;
+    QString message;
+};
+
+static QMutex debugQueueMutex;
+static QVector<DebugEntry> debugQueue(c_debugQueueCapacity); // Ring buffer
+static int debugQueueHead = 0;
+static int debugQueueCount = 0;
+static int debugQueueDropped = 0;
+static bool debugQueueProcessingScheduled = false;
+// The context strings of the queued messages. Usually these are literals, but
+// not necessarily (e.g. the categories with names built at runtime). The set
+// is bounded by the number of the call sites and categories.
+static QSet<QByteArray> internedStrings;
+
+// The category filters are called from any thread
+static QMutex categoryLevelsMutex;
+static QHash<QByteArray, int> categoryLevels; // Category name to the minimum severity
+
+// Must be called with debugQueueMutex locked
+static const char *internString(const char *string)
+{
+    if (!string) {
+        return nullptr;
+    }
+    QSet<QByteArray>::const_iterator it = internedStrings.constFind(QByteArray::fromRawData(string, qstrlen(string)));
+    if (it == internedStrings.constEnd()) {
+        it = internedStrings.insert(QByteArray(string));
+    }
+    return it->constData();
+}
+
+static int severity(QtMsgType type)
+{
+    switch (type) {
+    case QtDebugMsg:
+        return 0;
+    case QtInfoMsg:
+        return 1;
+    case QtWarningMsg:
+        return 2;
+    case QtCriticalMsg:
+        return 3;
+    case QtFatalMsg:
+        break;
+    }
+    return 4;
+}
+
+static void filterCategory(QLoggingCategory *category)
+{
+    if (defaultCategoryFilter) {
+        defaultCategoryFilter(category);
+    }
+
+    int minimumSeverity = 0;
+    {
+        QMutexLocker locker(&categoryLevelsMutex);
+        QHash<QByteArray, int>::const_iterator it = categoryLevels.constFind(QByteArray(category->categoryName()));
+        if (it == categoryLevels.constEnd()) {
+            return;
         }
+        minimumSeverity = it.value();
+    }
+    category->setEnabled(QtDebugMsg, severity(QtDebugMsg) >= minimumSeverity);
+    category->setEnabled(QtInfoMsg, severity(QtInfoMsg) >= minimumSeverity);
+    category->setEnabled(QtWarningMsg, severity(QtWarningMsg) >= minimumSeverity);
+    category->setEnabled(QtCriticalMsg, severity(QtCriticalMsg) >= minimumSeverity);
+}
+
+/**
+ * Set the minimum level of messages of the \a category. The disabled
+ * messages are rejected by QLoggingCategory before they are even formatted.
+ */
+void setDebugCategoryLevel(const QByteArray &category, QtMsgType minimumLevel)
+{
+    {
+        QMutexLocker locker(&categoryLevelsMutex);
+        categoryLevels.insert(category, severity(minimumLevel));
+    }
+
+    // Reinstalling the filter reapplies it to all categories
+    QLoggingCategory::CategoryFilter previousFilter = QLoggingCategory::installFilter(filterCategory);
+    if (previousFilter != filterCategory) {
+        defaultCategoryFilter = previousFilter;
+    }
+}
+
+static void publishDebugMessage(const DebugEntry &entry)
+{
+    if (debugInterfacePtr.isNull()) {
+        return;
+    }
+
+    QByteArray fileName = QByteArray::fromRawData(entry.file, qstrlen(entry.file));
 
-        domain = domain.arg(QString::fromLocal8Bit(fileName)).arg(context.line).arg(QString::fromLatin1(context.function));
-        QString message = msg;
-        if (message.startsWith(QLatin1String(context.function))) {
-            message = message.mid(qstrlen(context.function));
-            if (message.startsWith(QLatin1Char(' '))) {
-                message.remove(0, 1);
-            }
+    static const char *namesToWrap[] = {
+        "morse",
+        "telepathy-qt"
+    };
+
+    for (int i = 0; i < 2; ++i) {
+        int index = fileName.indexOf(namesToWrap[i]);
+        if (index < 0) {
+            continue;
         }
 
-        switch (type) {
-        case QtDebugMsg:
-            debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelDebug, message);
-            break;
-        case QtInfoMsg:
-            debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelInfo, message);
-            break;
-        case QtWarningMsg:
-            debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelWarning, message);
-            break;
-        case QtCriticalMsg:
-            debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelCritical, message);
-            break;
-        case QtFatalMsg:
-            debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelError, message);
-            break;
+        fileName = fileName.mid(index);
+        break;
+    }
+
+    const QString domain = QString::fromLocal8Bit(fileName) + QLatin1Char(':') + QString::number(entry.line)
+            + QLatin1String(", ") + QString::fromLatin1(entry.function);
+    QString message = entry.message;
+    if (entry.function && message.startsWith(QLatin1String(entry.function))) {
+        message = message.mid(qstrlen(entry.function));
+        if (message.startsWith(QLatin1Char(' '))) {
+            message.remove(0, 1);
         }
     }
 
+    switch (entry.type) {
+    case QtDebugMsg:
+        debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelDebug, message);
+        break;
+    case QtInfoMsg:
+        debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelInfo, message);
+        break;
+    case QtWarningMsg:
+        debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelWarning, message);
+        break;
+    case QtCriticalMsg:
+        debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelCritical, message);
+        break;
+    case QtFatalMsg:
+        debugInterfacePtr->newDebugMessage(domain, Tp::DebugLevelError, message);
+        break;
+    }
+}
+
+static void writeDebugMessage(const DebugEntry &entry, QByteArray *output)
+{
+    const QMessageLogContext context(entry.file, entry.line, entry.function, entry.category);
     if (defaultMessageHandler) {
-        defaultMessageHandler(type, context, msg);
+        defaultMessageHandler(entry.type, context, entry.message);
         return;
     }
 
 #if QT_VERSION >= QT_VERSION_CHECK(5, 4, 0)
-    const QString logMessage = qFormatLogMessage(type, context, msg);
+    const QString logMessage = qFormatLogMessage(entry.type, context, entry.message);
 
     if (logMessage.isNull()) {
         return;
     }
 #else
-    const QString logMessage = QString::number(type) + QLatin1Char('|') + msg;
+    const QString logMessage = QString::number(entry.type) + QLatin1Char('|') + entry.message;
 #endif
 
-    fprintf(stderr, "%s\n", logMessage.toLocal8Bit().constData());
-    fflush(stderr);
+    output->append(logMessage.toLocal8Bit());
+    output->append('\n');
+}
+
+static void processQueuedDebugMessages()
+{
+    QVector<DebugEntry> entries;
+    int dropped = 0;
+    {
+        QMutexLocker locker(&debugQueueMutex);
+        entries.reserve(debugQueueCount);
+        for (int i = 0; i < debugQueueCount; ++i) {
+            DebugEntry &entry = debugQueue[(debugQueueHead + i) % c_debugQueueCapacity];
+            entries.append(entry);
+            entry.message = QString();
+        }
+        debugQueueHead = 0;
+        debugQueueCount = 0;
+        dropped = debugQueueDropped;
+        debugQueueDropped = 0;
+        debugQueueProcessingScheduled = false;
+    }
+
+    QByteArray output;
+    if (dropped) {
+        output = "Debug queue overflow, messages dropped: " + QByteArray::number(dropped) + '\n';
+    }
+    for (const DebugEntry &entry : entries) {
+        publishDebugMessage(entry);
+        writeDebugMessage(entry, &output);
+    }
+
+    if (!output.isEmpty()) {
+        fwrite(output.constData(), 1, static_cast<size_t>(output.size()), stderr);
+        fflush(stderr);
+    }
+}
+
+void debugViaDBusInterface(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    DebugEntry entry;
+    entry.type = type;
+    entry.line = context.line;
+    entry.file = context.file ? context.file : "";
+    entry.function = context.function ? context.function : "";
+    entry.category = context.category;
+    entry.message = msg;
+
+    if ((type == QtFatalMsg) || debugInterfacePtr.isNull()) {
+        // The process is about to abort (or the event loop is gone), write everything right now
+        processQueuedDebugMessages();
+        QByteArray output;
+        publishDebugMessage(entry);
+        writeDebugMessage(entry, &output);
+        fwrite(output.constData(), 1, static_cast<size_t>(output.size()), stderr);
+        fflush(stderr);
+        return;
+    }
+
+    // The callers only pay for the enqueue; the formatting, D-Bus and stderr
+    // output are done in a batch on the next event loop iteration.
+    bool scheduleProcessing = false;
+    {
+        QMutexLocker locker(&debugQueueMutex);
+        entry.file = internString(entry.file);
+        entry.function = internString(entry.function);
+        entry.category = internString(entry.category);
+        if (debugQueueCount == c_debugQueueCapacity) {
+            debugQueueHead = (debugQueueHead + 1) % c_debugQueueCapacity;
+            --debugQueueCount;
+            ++debugQueueDropped;
+        }
+        debugQueue[(debugQueueHead + debugQueueCount) % c_debugQueueCapacity] = entry;
+        ++debugQueueCount;
+        scheduleProcessing = !debugQueueProcessingScheduled;
+        debugQueueProcessingScheduled = true;
+    }
+
+    if (scheduleProcessing) {
+        QTimer::singleShot(0, debugInterfacePtr.data(), processQueuedDebugMessages);
+    }
 }
 
 bool enableDebugInterface()
@@ -133,17 +424,32 @@ bool enableDebugInterface()
     debugInterfacePtr = new Tp::BaseDebug();
 #endif
 
-    debugInterfacePtr->setGetMessagesLimit(-1);
+    debugInterfacePtr->setGetMessagesLimit(c_debugMessagesLimit);
 
     if (!debugInterfacePtr->registerObject(TP_QT_CONNECTION_MANAGER_BUS_NAME_BASE + QLatin1String("morse"))) {
         return false;
     }
 
+    MorseLoggingControl *loggingControl = new MorseLoggingControl(debugInterfacePtr.data());
+    if (!QDBusConnection::sessionBus().registerObject(c_loggingObjectPath, loggingControl, QDBusConnection::ExportScriptableSlots)) {
+        qWarning() << "Unable to register the logging control object";
+    }
+
+    MorseMetricsExporter *metricsExporter = new MorseMetricsExporter(debugInterfacePtr.data());
+    if (!QDBusConnection::sessionBus().registerObject(c_metricsObjectPath, metricsExporter, QDBusConnection::ExportScriptableSlots)) {
+        qWarning() << "Unable to register the metrics object";
+    }
+
+    MorseTracingControl *tracingControl = new MorseTracingControl(debugInterfacePtr.data());
+    if (!QDBusConnection::sessionBus().registerObject(c_tracingObjectPath, tracingControl, QDBusConnection::ExportScriptableSlots)) {
+        qWarning() << "Unable to register the tracing object";
+    }
+
     defaultMessageHandler = qInstallMessageHandler(debugViaDBusInterface);
+    // Do not lose the messages queued at exit
+    qAddPostRoutine(processQueuedDebugMessages);
     return true;
 }
 #endif
 
-#if TP_QT_VERSION < TP_QT_VERSION_CHECK(0, 9, 8)
 #include "debug.moc"
-#endif
@@ -20,6 +20,10 @@
 #ifndef MORSE_DEBUG_HPP
 #define MORSE_DEBUG_HPP
 
+#include <QByteArray>
+#include <QtGlobal>
+
 bool enableDebugInterface();
+void setDebugCategoryLevel(const QByteArray &category, QtMsgType minimumLevel);
 
 #endif // MORSE_DEBUG_HPP
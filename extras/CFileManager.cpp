@@ -1,80 +1,252 @@
 #include "CFileManager.hpp"
+#include "filecache.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
 
 #include <TelegramQt/Client>
+#include <TelegramQt/DataStorage>
 #include <TelegramQt/Debug>
+#include <TelegramQt/FileOperation>
+#include <TelegramQt/FilesApi>
 
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QIODevice>
+#include <QMimeDatabase>
 
 static const int c_maxConcurrentDownloads = 8;
 
+/* Output device for a download. Passes the received data to the file manager. */
+class FileRequestDevice : public QIODevice
+{
+public:
+    FileRequestDevice(CFileManager *manager, quint32 requestId, quint32 totalSize) :
+        QIODevice(manager),
+        m_manager(manager),
+        m_requestId(requestId),
+        m_totalSize(totalSize)
+    {
+        open(QIODevice::WriteOnly);
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        Q_UNUSED(data)
+        Q_UNUSED(maxSize)
+        return -1;
+    }
+
+    qint64 writeData(const char *data, qint64 size) override
+    {
+        // The data is copied straight to the file buffer, no need for a temporary copy
+        m_manager->onFilePartReceived(m_requestId, QByteArray::fromRawData(data, static_cast<int>(size)), QString(),
+                                      static_cast<quint32>(pos()), m_totalSize);
+        return size;
+    }
+
+    CFileManager *m_manager;
+    quint32 m_requestId;
+    quint32 m_totalSize;
+};
+
 void FileInfo::setMimeType(const QString &type)
 {
     m_mimeType = type;
 }
 
-void FileInfo::addData(const QByteArray &newData)
+void FileInfo::setFileName(const QString &fileName)
+{
+    m_fileName = fileName;
+}
+
+quint32 FileInfo::receivedSize() const
 {
-    m_data += newData;
+    quint32 result = 0;
+    for (QMap<quint32,quint32>::const_iterator it = m_ranges.constBegin(); it != m_ranges.constEnd(); ++it) {
+        result += it.value() - it.key();
+    }
+    return result;
 }
 
-void FileInfo::completeDownload(const Telegram::RemoteFile &result)
+bool FileInfo::isCovered() const
 {
-    Q_UNUSED(result)
+    return m_totalSize && (m_ranges.count() == 1) && (m_ranges.firstKey() == 0) && (m_ranges.first() >= m_totalSize);
+}
+
+void FileInfo::setTotalSize(quint32 size)
+{
+    if (size < dataEnd()) {
+        return;
+    }
+    m_totalSize = size;
+    if (!isStreamed()) {
+        // Allocate the whole buffer at once to avoid reallocations on each chunk
+        m_data.resize(static_cast<int>(size));
+    }
+}
+
+void FileInfo::addData(quint32 offset, const QByteArray &newData)
+{
+    const quint32 chunkEnd = offset + static_cast<quint32>(newData.size());
+    if (!isStreamed()) {
+        if (chunkEnd > static_cast<quint32>(m_data.size())) {
+            // Unknown or wrong total size
+            m_data.reserve(static_cast<int>(qMax(chunkEnd, static_cast<quint32>(m_data.capacity()) * 2)));
+            m_data.resize(static_cast<int>(chunkEnd));
+        }
+        memcpy(m_data.data() + offset, newData.constData(), static_cast<size_t>(newData.size()));
+    }
+    addRange(offset, chunkEnd);
+}
+
+void FileInfo::completeDownload()
+{
+    if (static_cast<quint32>(m_data.size()) > dataEnd()) {
+        m_data.truncate(static_cast<int>(dataEnd()));
+    }
+    if (m_mimeType.isEmpty()) {
+        m_mimeType = isStreamed() ? QMimeDatabase().mimeTypeForFile(m_fileName).name()
+                                  : QMimeDatabase().mimeTypeForData(m_data).name();
+    }
     m_complete = true;
 }
 
+void FileInfo::addRange(quint32 begin, quint32 end)
+{
+    if (begin >= end) {
+        return;
+    }
+
+    // Merge with the previous range if it overlaps or adjoins the new one
+    QMap<quint32,quint32>::iterator it = m_ranges.upperBound(begin);
+    if (it != m_ranges.begin()) {
+        QMap<quint32,quint32>::iterator previous = it;
+        --previous;
+        if (previous.value() >= begin) {
+            if (previous.value() >= end) {
+                return; // Already received
+            }
+            begin = previous.key();
+            it = m_ranges.erase(previous);
+        }
+    }
+
+    // Absorb the next ranges
+    while ((it != m_ranges.end()) && (it.key() <= end)) {
+        end = qMax(end, it.value());
+        it = m_ranges.erase(it);
+    }
+
+    m_ranges.insert(begin, end);
+}
+
 CFileManager::CFileManager(Telegram::Client::Client *backend, QObject *parent) :
     QObject(parent),
-    m_backend(backend)
+    m_backend(backend),
+    m_pendingQueues(PrioritiesCount)
+{
+}
+
+CFileManager::~CFileManager()
+{
+    MorseMetrics::addToGauge(MorseMetrics::PendingDownloads, -m_reportedDownloads);
+}
+
+void CFileManager::setCacheDirectory(const QString &directory)
 {
-//    connect(m_backend, SIGNAL(filePartReceived(quint32,QByteArray,QString,quint32,quint32)),
-//            SLOT(onFilePartReceived(quint32,QByteArray,QString,quint32,quint32)));
-//    connect(m_backend, SIGNAL(fileRequestFinished(quint32,Telegram::RemoteFile)),
-//            this, SLOT(onFileRequestFinished(quint32,Telegram::RemoteFile)));
+    m_cacheDirectory = directory;
 }
 
-QString CFileManager::requestFile(const Telegram::RemoteFile &file)
+QString CFileManager::requestFile(const Telegram::RemoteFile &file, Priority priority, Storage storage)
 {
     const QString key = file.getUniqueId();
+    if (key.isEmpty()) {
+        return QString();
+    }
     if (m_files.contains(key)) {
-        qDebug() << Q_FUNC_INFO << key << "already requested";
+        qCDebug(lcMorseFiles) << Q_FUNC_INFO << key << "already requested";
         return key; // Already requested
     }
-    qDebug() << Q_FUNC_INFO << key << "requested";
+    qCDebug(lcMorseFiles) << Q_FUNC_INFO << key << "requested";
     FileInfo requestFileInfo;
+    if (storage == StorageFile) {
+        const QString fileName = getFilePath(key);
+        if (fileName.isEmpty()) {
+            qCWarning(lcMorseFiles) << Q_FUNC_INFO << "The cache directory is not set";
+            return QString();
+        }
+        requestFileInfo.setFileName(fileName);
+        if (QFile::exists(fileName)) {
+            // Downloaded earlier (partial downloads have a different name).
+            // No requestComplete() signal in this case, the file info is complete right away.
+            requestFileInfo.completeDownload();
+            m_files.insert(key, requestFileInfo);
+            return key;
+        }
+    }
     m_files.insert(key, requestFileInfo);
 
-    if (m_requestToStringId.count() >= c_maxConcurrentDownloads) {
-        m_pendingRequests.insert(key, file);
-        qDebug() << Q_FUNC_INFO << "Request delayed" << key;
+    m_pendingRequests.insert(key, file);
+    m_pendingQueues[priority].enqueue(key);
+
+    if (m_runningRequests >= c_maxConcurrentDownloads) {
+        qCDebug(lcMorseFiles) << Q_FUNC_INFO << "Request delayed" << key;
+        updateDownloadsMetrics();
         return key;
     }
 
-    const quint32 requestId = 0;//m_backend->requestFile(&file);
-    if (!requestId) {
-        qDebug() << Q_FUNC_INFO << "File is not available" << key;
-        return QString();
-    }
-    m_requestToStringId.insert(requestId, key);
+    processPendingRequests();
     return key;
 }
 
-QString CFileManager::requestPeerPicture(const Telegram::Peer &peer, Telegram::PeerPictureSize size)
+QString CFileManager::requestPeerPicture(const Telegram::Peer &peer, Telegram::PeerPictureSize size, Priority priority)
 {
     Telegram::RemoteFile file;
     if (!getPeerPictureFileInfo(peer, &file, size)) {
         return QString();
     }
 
-    const QString key = requestFile(file);
-    qDebug() << Q_FUNC_INFO << peer << key;
+    const QString key = requestFile(file, priority);
+    qCDebug(lcMorseFiles) << Q_FUNC_INFO << peer << key;
     if (key.isEmpty()) {
         return QString();
     }
     return key;
 }
 
+void CFileManager::cancelRequest(const QString &uniqueId)
+{
+    if (!m_files.contains(uniqueId) || m_files.value(uniqueId).isComplete()) {
+        return;
+    }
+    qCDebug(lcMorseFiles) << Q_FUNC_INFO << uniqueId;
+    dropFile(uniqueId);
+
+    // The queued key is skipped on unqueue
+    if (m_pendingRequests.remove(uniqueId)) {
+        updateDownloadsMetrics();
+        return;
+    }
+
+    // The backend operation can not be aborted, so just forget the request;
+    // the rest of the data is dropped on arrival. The download slot is freed
+    // once the operation finishes.
+    const quint32 requestId = m_stringIdToRequest.take(uniqueId);
+    if (requestId) {
+        m_requestToStringId.remove(requestId);
+    }
+}
+
+void CFileManager::releaseFile(const QString &uniqueId)
+{
+    if (!m_files.contains(uniqueId) || !m_files.value(uniqueId).isComplete()) {
+        return;
+    }
+    m_files.remove(uniqueId);
+}
+
 const FileInfo *CFileManager::getFileInfo(const QString &uniqueId)
 {
     if (!m_files.contains(uniqueId)) {
@@ -88,8 +260,16 @@ QByteArray CFileManager::getData(const QString &uniqueId) const
     if (!m_files.contains(uniqueId)) {
         return QByteArray();
     }
-    const FileInfo &info = m_files.value(uniqueId);
-    return info.data();
+    // Implicitly shared, no deep copy
+    return m_files.constFind(uniqueId)->data();
+}
+
+QString CFileManager::getFilePath(const QString &uniqueId) const
+{
+    if (m_cacheDirectory.isEmpty()) {
+        return QString();
+    }
+    return m_cacheDirectory + QLatin1Char('/') + MorseFileCache::fileName(uniqueId);
 }
 
 bool CFileManager::getPeerPictureFileInfo(const Telegram::Peer &peer, Telegram::RemoteFile *file, Telegram::PeerPictureSize size) const
@@ -98,14 +278,18 @@ bool CFileManager::getPeerPictureFileInfo(const Telegram::Peer &peer, Telegram::
     case Telegram::Peer::User:
     {
         Telegram::UserInfo info;
-        //m_backend->getUserInfo(&info, peer.id);
+        if (!m_backend->dataStorage()->getUserInfo(&info, peer.id)) {
+            return false;
+        }
         return info.getPeerPicture(file, size);
     }
     case Telegram::Peer::Chat:
     case Telegram::Peer::Channel:
     {
         Telegram::ChatInfo info;
-        //m_backend->getChatInfo(&info, peer);
+        if (!m_backend->dataStorage()->getChatInfo(&info, peer)) {
+            return false;
+        }
         return info.getPeerPicture(file, size);
     }
     default:
@@ -116,9 +300,6 @@ bool CFileManager::getPeerPictureFileInfo(const Telegram::Peer &peer, Telegram::
 
 void CFileManager::onFilePartReceived(quint32 requestId, const QByteArray &data, const QString &mimeType, quint32 offset, quint32 totalSize)
 {
-    Q_UNUSED(offset)
-    Q_UNUSED(totalSize)
-
     const QString key = m_requestToStringId.value(requestId);
     if (key.isEmpty()) {
         // Unknown requestId
@@ -130,31 +311,126 @@ void CFileManager::onFilePartReceived(quint32 requestId, const QByteArray &data,
     }
 
     FileInfo &info = m_files[key];
+    if (info.isComplete()) {
+        return;
+    }
     if (info.mimeType().isEmpty() && !mimeType.isEmpty()) {
         info.setMimeType(mimeType);
     }
-    info.addData(data);
+    if (totalSize && !info.totalSize()) {
+        info.setTotalSize(totalSize);
+    }
+    if (info.isStreamed()) {
+        QFile *file = m_openFiles.value(key);
+        if (!file || !file->seek(offset) || (file->write(data) != data.size())) {
+            // The request is reported as failed on finish due to the missing range
+            qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Unable to write the file part:" << key << offset << data.size();
+            return;
+        }
+    }
+    info.addData(offset, data);
+    emit requestProgress(key, info.receivedSize(), info.totalSize());
+
+    // Parts can come in any order (and from several requests), so the file is
+    // complete once the whole range is received rather than on the last part.
+    if (info.isCovered()) {
+        completeFile(key);
+    }
 }
 
-void CFileManager::onFileRequestFinished(quint32 requestId, const Telegram::RemoteFile &requestResult)
+void CFileManager::onFileRequestFinished(quint32 requestId, bool succeeded)
 {
-    Q_UNUSED(requestResult)
-
     const QString key = m_requestToStringId.take(requestId);
-    if (key.isEmpty()) {
-        // Unknown requestId
-        return;
+    if (!key.isEmpty()) {
+        m_stringIdToRequest.remove(key);
     }
-    if (!m_files.contains(key)) {
-        // Unknown key. Assert?
-        return;
+
+    // An empty key is for a cancelled request, only its slot is freed
+    if (!key.isEmpty() && m_files.contains(key) && !m_files.value(key).isComplete()) {
+        const FileInfo &info = m_files[key];
+        if (succeeded && (!info.totalSize() || info.isCovered())) {
+            qCDebug(lcMorseFiles) << Q_FUNC_INFO << "Request complete:" << key << requestId;
+            completeFile(key);
+        } else {
+            if (succeeded) {
+                qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Request finished, but the file is incomplete:"
+                           << info.receivedSize() << "of" << info.totalSize();
+            }
+            dropFile(key);
+            qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Request failed:" << key << requestId;
+            MorseMetrics::increment(MorseMetrics::FileDownloadsFailed);
+            emit requestFailed(key);
+        }
+    }
+
+    processPendingRequests();
+}
+
+void CFileManager::completeFile(const QString &uniqueId)
+{
+    FileInfo &info = m_files[uniqueId];
+    if (info.isStreamed()) {
+        closeFile(uniqueId);
+        QFile::remove(info.fileName());
+        if (!QFile::rename(info.fileName() + MorseFileCache::partialFileSuffix(), info.fileName())) {
+            qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Unable to finalize the file" << info.fileName();
+            dropFile(uniqueId);
+            MorseMetrics::increment(MorseMetrics::FileDownloadsFailed);
+            emit requestFailed(uniqueId);
+            return;
+        }
+    }
+    info.completeDownload();
+    MorseMetrics::increment(MorseMetrics::FilesDownloaded);
+    emit requestComplete(uniqueId);
+}
+
+void CFileManager::dropFile(const QString &uniqueId)
+{
+    const FileInfo info = m_files.take(uniqueId);
+    if (info.isStreamed() && !info.isComplete()) {
+        closeFile(uniqueId);
+        QFile::remove(info.fileName() + MorseFileCache::partialFileSuffix());
     }
+}
+
+bool CFileManager::openFile(const QString &uniqueId, FileInfo *info)
+{
+    QDir().mkpath(m_cacheDirectory);
+    QFile *file = new QFile(info->fileName() + MorseFileCache::partialFileSuffix(), this);
+    if (!file->open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Unable to open" << file->fileName() << file->errorString();
+        delete file;
+        return false;
+    }
+    m_openFiles.insert(uniqueId, file);
+    return true;
+}
+
+void CFileManager::closeFile(const QString &uniqueId)
+{
+    QFile *file = m_openFiles.take(uniqueId);
+    if (file) {
+        file->close();
+        delete file;
+    }
+}
 
-    m_files[key].completeDownload(requestResult);
-    qDebug() << Q_FUNC_INFO << "Request complete:" << key << requestId;
-    emit requestComplete(key);
+void CFileManager::processPendingRequests()
+{
+    while (m_runningRequests < c_maxConcurrentDownloads) {
+        if (unqueuePendingRequest().isEmpty()) {
+            break;
+        }
+    }
+    updateDownloadsMetrics();
+}
 
-    unqueuePendingRequest();
+void CFileManager::updateDownloadsMetrics()
+{
+    const int downloads = m_pendingRequests.count() + m_runningRequests;
+    MorseMetrics::addToGauge(MorseMetrics::PendingDownloads, downloads - m_reportedDownloads);
+    m_reportedDownloads = downloads;
 }
 
 QString CFileManager::unqueuePendingRequest()
@@ -163,16 +439,58 @@ QString CFileManager::unqueuePendingRequest()
         return QString();
     }
 
-    qDebug() << Q_FUNC_INFO << "remains:" << m_pendingRequests.count() << m_pendingRequests.keys();
-    const QString key = *m_pendingRequests.keyBegin();
-    const Telegram::RemoteFile info = m_pendingRequests.take(key);
-    qDebug() << Q_FUNC_INFO << "took key:" << key;
+    qCDebug(lcMorseFiles) << Q_FUNC_INFO << "remains:" << m_pendingRequests.count();
+    for (int priority = PrioritiesCount - 1; priority >= 0; --priority) {
+        QQueue<QString> &queue = m_pendingQueues[priority];
+        while (!queue.isEmpty()) {
+            const QString key = queue.dequeue();
+            if (!m_pendingRequests.contains(key)) {
+                // Cancelled
+                continue;
+            }
+            const Telegram::RemoteFile info = m_pendingRequests.take(key);
+            qCDebug(lcMorseFiles) << Q_FUNC_INFO << "took key:" << key;
 
-    const quint32 requestId = 0;//m_backend->requestFile(&info);
-    if (!requestId) {
-        qDebug() << Q_FUNC_INFO << "File is not available" << key;
-        return QString();
+            if (!startRequest(key, info)) {
+                qCDebug(lcMorseFiles) << Q_FUNC_INFO << "File is not available" << key;
+                dropFile(key);
+                MorseMetrics::increment(MorseMetrics::FileDownloadsFailed);
+                emit requestFailed(key);
+                continue;
+            }
+            return key;
+        }
     }
-    m_requestToStringId.insert(requestId, key);
-    return key;
+
+    return QString();
+}
+
+bool CFileManager::startRequest(const QString &uniqueId, const Telegram::RemoteFile &file)
+{
+    FileInfo &info = m_files[uniqueId];
+    if (info.isStreamed() && !openFile(uniqueId, &info)) {
+        return false;
+    }
+
+    const quint32 requestId = ++m_lastRequestId;
+    FileRequestDevice *device = new FileRequestDevice(this, requestId, file.size());
+
+    Telegram::Client::FileOperation *operation = m_backend->filesApi()->downloadFile(uniqueId, device);
+    if (!operation) {
+        delete device;
+        return false;
+    }
+
+    m_requestToStringId.insert(requestId, uniqueId);
+    m_stringIdToRequest.insert(uniqueId, requestId);
+    ++m_runningRequests;
+    QElapsedTimer downloadTimer;
+    downloadTimer.start();
+    connect(operation, &Telegram::PendingOperation::finished, this, [this, requestId, operation, device, downloadTimer]() {
+        device->deleteLater();
+        --m_runningRequests;
+        MorseMetrics::addSample(MorseMetrics::FileDownloadTime, downloadTimer.nsecsElapsed() / 1000);
+        onFileRequestFinished(requestId, operation->isSucceeded());
+    });
+    return true;
 }
@@ -3,6 +3,9 @@
 
 #include <QObject>
 #include <QHash>
+#include <QMap>
+#include <QQueue>
+#include <QVector>
 
 #include <TelegramQt/TelegramNamespace>
 
@@ -11,42 +14,54 @@ namespace Telegram {
 namespace Client {
 
 class Client;
+class FileOperation;
 class FilesApi;
 
 } // Client namespace
 
 } // Telegram namespace
 
+class QFile;
+
 class CFileManager;
+class FileRequestDevice;
 
 struct FileInfo
 {
     FileInfo() :
+        m_totalSize(0),
         m_complete(false)
     {
     }
 
-    FileInfo(const FileInfo &fileInfo) :
-        FileInfo()
-    {
-        m_data = fileInfo.m_data;
-        m_mimeType = fileInfo.m_mimeType;
-        m_complete = fileInfo.m_complete;
-    }
-
     bool isComplete() const { return m_complete; }
-    QByteArray data() const { return m_data; }
+    // The buffer is implicitly shared, keep a copy of the returned value to retain the data
+    const QByteArray &data() const { return m_data; }
     QString mimeType() const { return m_mimeType; }
+    // Streamed files are written to the cache directory instead of the memory
+    bool isStreamed() const { return !m_fileName.isEmpty(); }
+    QString fileName() const { return m_fileName; }
+    quint32 totalSize() const { return m_totalSize; }
+    quint32 receivedSize() const;
+    bool isCovered() const;
 
     // FileManager interface:
     void setMimeType(const QString &type);
+    void setFileName(const QString &fileName);
+    void setTotalSize(quint32 size);
 
-    void addData(const QByteArray &newData);
-    void completeDownload(const Telegram::RemoteFile &result);
+    void addData(quint32 offset, const QByteArray &newData);
+    void completeDownload();
 
 private:
+    quint32 dataEnd() const { return m_ranges.isEmpty() ? 0 : m_ranges.last(); }
+    void addRange(quint32 begin, quint32 end);
+
     QByteArray m_data;
     QString m_mimeType;
+    QString m_fileName;
+    QMap<quint32,quint32> m_ranges; // Received (non-overlapping) ranges, begin to end
+    quint32 m_totalSize;
     bool m_complete;
 
 };
@@ -55,30 +70,69 @@ class CFileManager : public QObject
 {
     Q_OBJECT
 public:
+    enum Priority {
+        PriorityLow,
+        PriorityNormal,
+        PriorityHigh,
+        PrioritiesCount
+    };
+
+    enum Storage {
+        StorageMemory,
+        StorageFile
+    };
+
     explicit CFileManager(Telegram::Client::Client *backend, QObject *parent = nullptr);
+    ~CFileManager();
+
+    QString cacheDirectory() const { return m_cacheDirectory; }
+    void setCacheDirectory(const QString &directory);
 
-    QString requestFile(const Telegram::RemoteFile &file);
-    QString requestPeerPicture(const Telegram::Peer &peer, Telegram::PeerPictureSize size = Telegram::PeerPictureSize::Small);
+    QString requestFile(const Telegram::RemoteFile &file, Priority priority = PriorityNormal, Storage storage = StorageMemory);
+    QString requestPeerPicture(const Telegram::Peer &peer, Telegram::PeerPictureSize size = Telegram::PeerPictureSize::Small,
+                               Priority priority = PriorityHigh);
+    void cancelRequest(const QString &uniqueId);
+    void releaseFile(const QString &uniqueId);
 
     const FileInfo *getFileInfo(const QString &uniqueId);
     QByteArray getData(const QString &uniqueId) const;
+    QString getFilePath(const QString &uniqueId) const;
     bool getPeerPictureFileInfo(const Telegram::Peer &peer, Telegram::RemoteFile *file, Telegram::PeerPictureSize size = Telegram::PeerPictureSize::Small) const;
 
 signals:
     void requestComplete(const QString &uniqueId);
+    void requestFailed(const QString &uniqueId);
+    void requestProgress(const QString &uniqueId, quint32 receivedSize, quint32 totalSize);
 
 protected slots:
     void onFilePartReceived(quint32 requestId, const QByteArray &data, const QString &mimeType, quint32 offset, quint32 totalSize);
-    void onFileRequestFinished(quint32 requestId, const Telegram::RemoteFile &requestResult);
+    void onFileRequestFinished(quint32 requestId, bool succeeded);
 
 protected:
+    void completeFile(const QString &uniqueId);
+    void dropFile(const QString &uniqueId);
+    bool openFile(const QString &uniqueId, FileInfo *info);
+    void closeFile(const QString &uniqueId);
+    void processPendingRequests();
     QString unqueuePendingRequest();
+    bool startRequest(const QString &uniqueId, const Telegram::RemoteFile &file);
+    void updateDownloadsMetrics();
 
     Telegram::Client::Client *m_backend;
     QHash<QString,FileInfo> m_files; // UniqueId to file info
-    QHash<quint32,QString> m_requestToStringId; // Request number to UniqueId
+    QHash<QString,QFile*> m_openFiles; // UniqueId to the partial file of a streamed download
+    QString m_cacheDirectory;
+    QHash<quint32,QString> m_requestToStringId; // Request number to UniqueId (active requests)
+    QHash<QString,quint32> m_stringIdToRequest; // UniqueId to request number (active requests)
+    int m_runningRequests = 0; // Backend operations in progress, including the cancelled ones
 
     QHash<QString,Telegram::RemoteFile> m_pendingRequests;
+    QVector<QQueue<QString>> m_pendingQueues; // FIFO of UniqueIds per priority
+
+    quint32 m_lastRequestId = 0;
+    int m_reportedDownloads = 0; // Contribution to the process wide PendingDownloads gauge
+
+    friend class FileRequestDevice;
 
 };
 
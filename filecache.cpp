@@ -0,0 +1,205 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "filecache.hpp"
+#include "logging.hpp"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+void MorseFileCache::setDirectory(const QString &directory)
+{
+    m_directory = directory;
+}
+
+void MorseFileCache::setMaximumSize(qint64 bytes)
+{
+    m_maximumSize = bytes;
+    if (m_size > m_maximumSize) {
+        evict(m_size - m_maximumSize);
+    }
+}
+
+void MorseFileCache::load()
+{
+    m_entries.clear();
+    m_accessOrder.clear();
+    m_size = 0;
+
+    // Oldest first, so the recently written files get the recent access ticks
+    const QFileInfoList files = QDir(m_directory).entryInfoList(QDir::Files, QDir::Time|QDir::Reversed);
+    for (const QFileInfo &fileInfo : files) {
+        if (fileInfo.fileName().endsWith(partialFileSuffix())) {
+            // Not complete yet (or interrupted), the downloader owns it
+            continue;
+        }
+        Entry entry;
+        entry.size = fileInfo.size();
+        entry.lastAccess = ++m_accessCounter;
+        m_entries.insert(fileInfo.fileName(), entry);
+        m_accessOrder.insert(entry.lastAccess, fileInfo.fileName());
+        m_size += entry.size;
+    }
+
+    qCDebug(lcMorseFiles) << Q_FUNC_INFO << m_directory << "files:" << m_entries.count() << "size:" << m_size;
+
+    if (m_size > m_maximumSize) {
+        evict(m_size - m_maximumSize);
+    }
+}
+
+bool MorseFileCache::contains(const QString &token) const
+{
+    return m_entries.contains(fileName(token));
+}
+
+QByteArray MorseFileCache::data(const QString &token)
+{
+    const QString name = fileName(token);
+    QHash<QString, Entry>::iterator it = m_entries.find(name);
+    if (it == m_entries.end()) {
+        return QByteArray();
+    }
+
+    QFile file(filePath(name));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Unable to read cached file" << file.fileName() << file.errorString();
+        remove(name);
+        return QByteArray();
+    }
+
+    touch(name, &it.value());
+    return file.readAll();
+}
+
+bool MorseFileCache::insert(const QString &token, const QByteArray &data)
+{
+    if (token.isEmpty() || data.isEmpty() || (data.size() > m_maximumSize)) {
+        return false;
+    }
+
+    const QString name = fileName(token);
+    if (m_entries.contains(name)) {
+        return true;
+    }
+
+    const qint64 bytesToFree = m_size + data.size() - m_maximumSize;
+    if (bytesToFree > 0) {
+        evict(bytesToFree);
+    }
+
+    QDir().mkpath(m_directory);
+    QSaveFile file(filePath(name));
+    if (!file.open(QIODevice::WriteOnly) || (file.write(data) != data.size()) || !file.commit()) {
+        qCWarning(lcMorseFiles) << Q_FUNC_INFO << "Unable to write cached file" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    Entry entry;
+    entry.size = data.size();
+    entry.lastAccess = ++m_accessCounter;
+    m_entries.insert(name, entry);
+    m_accessOrder.insert(entry.lastAccess, name);
+    m_size += entry.size;
+    return true;
+}
+
+bool MorseFileCache::addFile(const QString &token)
+{
+    const QString name = fileName(token);
+    if (m_entries.contains(name)) {
+        markUsed(token);
+        return true;
+    }
+
+    const QFileInfo fileInfo(filePath(name));
+    if (!fileInfo.exists()) {
+        return false;
+    }
+    if (fileInfo.size() > m_maximumSize) {
+        QFile::remove(fileInfo.filePath());
+        return false;
+    }
+
+    const qint64 bytesToFree = m_size + fileInfo.size() - m_maximumSize;
+    if (bytesToFree > 0) {
+        evict(bytesToFree);
+    }
+
+    Entry entry;
+    entry.size = fileInfo.size();
+    entry.lastAccess = ++m_accessCounter;
+    m_entries.insert(name, entry);
+    m_accessOrder.insert(entry.lastAccess, name);
+    m_size += entry.size;
+    return true;
+}
+
+void MorseFileCache::markUsed(const QString &token)
+{
+    const QString name = fileName(token);
+    QHash<QString, Entry>::iterator it = m_entries.find(name);
+    if (it != m_entries.end()) {
+        touch(name, &it.value());
+    }
+}
+
+/**
+ * Returns the name of the cached file of \a token (also used for the
+ * downloads written straight to the cache directory, see CFileManager::getFilePath()).
+ */
+QString MorseFileCache::fileName(const QString &token)
+{
+    // The unique id is not guaranteed to be a valid file name
+    return QString::fromLatin1(QCryptographicHash::hash(token.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+QString MorseFileCache::filePath(const QString &fileName) const
+{
+    return m_directory + QLatin1Char('/') + fileName;
+}
+
+void MorseFileCache::touch(const QString &fileName, Entry *entry)
+{
+    m_accessOrder.remove(entry->lastAccess);
+    entry->lastAccess = ++m_accessCounter;
+    m_accessOrder.insert(entry->lastAccess, fileName);
+}
+
+void MorseFileCache::remove(const QString &fileName)
+{
+    const Entry entry = m_entries.take(fileName);
+    m_accessOrder.remove(entry.lastAccess);
+    m_size -= entry.size;
+    QFile::remove(filePath(fileName));
+}
+
+void MorseFileCache::evict(qint64 bytesToFree)
+{
+    qint64 freed = 0;
+    while ((freed < bytesToFree) && !m_accessOrder.isEmpty()) {
+        const QString name = m_accessOrder.first();
+        freed += m_entries.value(name).size;
+        remove(name);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_FILECACHE_HPP
+#define MORSE_FILECACHE_HPP
+
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QString>
+
+/**
+ * On-disk file cache.
+ *
+ * Files are stored one per token (the RemoteFile unique id, which changes
+ * with the content). The total size is limited; least recently used
+ * files are evicted first.
+ *
+ * The cached data is either written via insert() (e.g. avatars), or written
+ * to the cache directory by the file manager and then registered via addFile()
+ * (media). Files with partialFileSuffix() are downloads in progress and are
+ * not accounted.
+ */
+class MorseFileCache
+{
+public:
+    QString directory() const { return m_directory; }
+    void setDirectory(const QString &directory);
+
+    qint64 maximumSize() const { return m_maximumSize; }
+    void setMaximumSize(qint64 bytes);
+
+    qint64 size() const { return m_size; }
+
+    void load();
+
+    bool contains(const QString &token) const;
+    QByteArray data(const QString &token);
+    bool insert(const QString &token, const QByteArray &data);
+    bool addFile(const QString &token);
+    void markUsed(const QString &token);
+
+    static QString fileName(const QString &token);
+    static QLatin1String partialFileSuffix() { return QLatin1String(".part"); }
+
+private:
+    struct Entry {
+        qint64 size;
+        quint64 lastAccess;
+    };
+
+    QString filePath(const QString &fileName) const;
+
+    void touch(const QString &fileName, Entry *entry);
+    void remove(const QString &fileName);
+    void evict(qint64 bytesToFree);
+
+    QString m_directory;
+    QHash<QString, Entry> m_entries; // File name to entry
+    QMap<quint64, QString> m_accessOrder; // Access tick to file name
+    quint64 m_accessCounter = 0;
+    qint64 m_maximumSize = 0;
+    qint64 m_size = 0;
+};
+
+#endif // MORSE_FILECACHE_HPP
@@ -0,0 +1,103 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "handleregistry.hpp"
+
+uint MorseHandleRegistry::handle(const Telegram::Peer &peer) const
+{
+    if (!peer.isValid()) {
+        return 0;
+    }
+    return m_index.value(peerKey(peer), 0);
+}
+
+Telegram::Peer MorseHandleRegistry::peer(uint handle) const
+{
+    if (!contains(handle)) {
+        return Telegram::Peer();
+    }
+    return m_peers.at(handle - 1);
+}
+
+/**
+ * Return the cached identifier of the \a handle, or an empty string for an unknown handle.
+ */
+QString MorseHandleRegistry::identifier(uint handle) const
+{
+    if (!contains(handle)) {
+        return QString();
+    }
+    return m_identifiers.at(handle - 1);
+}
+
+/**
+ * Return the handle of the \a peer, allocating a new one for an unknown peer.
+ * No handle is allocated for an invalid peer, 0 is returned instead.
+ */
+uint MorseHandleRegistry::ensureHandle(const Telegram::Peer &peer)
+{
+    if (!peer.isValid()) {
+        return 0;
+    }
+
+    uint result = handle(peer);
+    if (result) {
+        return result;
+    }
+
+    m_peers.append(peer);
+    m_identifiers.append(peer.toString());
+    result = lastHandle();
+    m_index.insert(peerKey(peer), result);
+    m_identifierIndex.insert(m_identifiers.last(), result);
+    return result;
+}
+
+/**
+ * Bind the \a handle to the \a peer. Used for the handles allocated before
+ * the peer is known (e.g. the self handle).
+ */
+void MorseHandleRegistry::setPeer(uint handle, const Telegram::Peer &peer)
+{
+    if (!handle) {
+        return;
+    }
+    if (handle > lastHandle()) {
+        m_peers.resize(handle);
+        m_identifiers.resize(handle);
+    }
+
+    const Telegram::Peer previousPeer = m_peers.at(handle - 1);
+    if (previousPeer.isValid() && (m_index.value(peerKey(previousPeer)) == handle)) {
+        m_index.remove(peerKey(previousPeer));
+        m_identifierIndex.remove(m_identifiers.at(handle - 1));
+    }
+
+    m_peers[handle - 1] = peer;
+    m_identifiers[handle - 1] = peer.isValid() ? peer.toString() : QString();
+    if (peer.isValid()) {
+        m_index.insert(peerKey(peer), handle);
+        m_identifierIndex.insert(m_identifiers.at(handle - 1), handle);
+    }
+}
+
+quint64 MorseHandleRegistry::peerKey(const Telegram::Peer &peer)
+{
+    return (static_cast<quint64>(peer.type) << 32) | peer.id;
+}
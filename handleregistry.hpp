@@ -0,0 +1,62 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_HANDLEREGISTRY_HPP
+#define MORSE_HANDLEREGISTRY_HPP
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <TelegramQt/TelegramNamespace>
+
+/**
+ * Bidirectional Telepathy handle <-> Telegram peer map.
+ *
+ * Handles are allocated monotonically starting from 1 and never reused,
+ * so the handle -> peer direction is a dense array and the peer -> handle
+ * direction is a hash. Both lookups are O(1). The identifier string of each
+ * handle is formatted once, on registration, and is indexed too, so known
+ * identifiers are resolved without parsing.
+ */
+class MorseHandleRegistry
+{
+public:
+    bool isEmpty() const { return m_peers.isEmpty(); }
+    bool contains(uint handle) const { return handle && (handle <= lastHandle()); }
+    uint lastHandle() const { return static_cast<uint>(m_peers.count()); }
+
+    uint handle(const Telegram::Peer &peer) const;
+    uint handle(const QString &identifier) const { return m_identifierIndex.value(identifier, 0); }
+    Telegram::Peer peer(uint handle) const;
+    QString identifier(uint handle) const;
+
+    uint ensureHandle(const Telegram::Peer &peer);
+    void setPeer(uint handle, const Telegram::Peer &peer);
+
+    static quint64 peerKey(const Telegram::Peer &peer);
+
+private:
+    QHash<quint64, uint> m_index;
+    QVector<Telegram::Peer> m_peers; // Handle N is stored at index N - 1
+    QVector<QString> m_identifiers; // Peer::toString() of the peers, same indices
+    QHash<QString, uint> m_identifierIndex;
+};
+
+#endif // MORSE_HANDLEREGISTRY_HPP
@@ -0,0 +1,170 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include "historysync.hpp"
+#include "handleregistry.hpp"
+#include "logging.hpp"
+
+#include <TelegramQt/Client>
+#include <TelegramQt/DataStorage>
+#include <TelegramQt/MessagingApi>
+
+#include <QDebug>
+
+#include <algorithm>
+
+static const int c_maxConcurrentRequests = 4;
+static const quint32 c_pageSize = 50;
+// Do not flood the client with the history of a long forgotten dialog.
+// The older messages are skipped (and logged), see onPageFetched().
+static const int c_maxMessagesPerDialog = 2000;
+
+MorseHistorySync::MorseHistorySync(Telegram::Client::Client *client, QObject *parent) :
+    QObject(parent),
+    m_client(client)
+{
+}
+
+/**
+ * \a deliveredMaxIds maps MorseHandleRegistry::peerKey() to the id of the
+ * newest message already delivered in the dialog (e.g. before a reconnection).
+ */
+void MorseHistorySync::start(const QVector<Telegram::Peer> &dialogs, const QHash<quint64, quint32> &deliveredMaxIds)
+{
+    stop();
+
+    for (const Telegram::Peer &peer : dialogs) {
+        Telegram::DialogInfo info;
+        if (!m_client->dataStorage()->getDialogInfo(&info, peer)) {
+            continue;
+        }
+        const quint32 minId = qMax(info.readInboxMaxId(), deliveredMaxIds.value(MorseHandleRegistry::peerKey(peer)));
+        if (!info.unreadCount() || (info.lastMessageId() <= minId)) {
+            continue;
+        }
+        Job job;
+        job.peer = peer;
+        job.minId = minId;
+        m_pendingJobs.enqueue(job);
+    }
+
+    qCDebug(lcMorseChannel) << Q_FUNC_INFO << "Dialogs to sync:" << m_pendingJobs.count();
+
+    processPendingJobs();
+}
+
+void MorseHistorySync::stop()
+{
+    ++m_generation;
+    m_pendingJobs.clear();
+    m_activeJobs.clear();
+}
+
+bool MorseHistorySync::isSyncing(const Telegram::Peer &peer) const
+{
+    for (const Job &job : m_activeJobs) {
+        if (job.peer == peer) {
+            return true;
+        }
+    }
+    for (const Job &job : m_pendingJobs) {
+        if (job.peer == peer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MorseHistorySync::processPendingJobs()
+{
+    while ((m_activeJobs.count() < c_maxConcurrentRequests) && !m_pendingJobs.isEmpty()) {
+        fetchPage(m_pendingJobs.dequeue());
+    }
+}
+
+void MorseHistorySync::fetchPage(const Job &job)
+{
+    Telegram::Client::MessageFetchOptions options;
+    options.limit = c_pageSize;
+    options.minId = job.minId;
+    options.offsetId = job.offsetId;
+
+    Telegram::Client::MessagesOperation *operation = m_client->messagingApi()->getHistory(job.peer, options);
+    m_activeJobs.insert(operation, job);
+
+    const quint32 generation = m_generation;
+    connect(operation, &Telegram::PendingOperation::finished, this, [this, operation, generation]() {
+        onPageFetched(operation, generation);
+    });
+}
+
+void MorseHistorySync::onPageFetched(Telegram::Client::MessagesOperation *operation, quint32 generation)
+{
+    if (generation != m_generation) {
+        // Stopped
+        return;
+    }
+
+    Job job = m_activeJobs.take(operation);
+    if (!operation->isSucceeded()) {
+        qCWarning(lcMorseChannel) << Q_FUNC_INFO << "Unable to fetch the history of" << job.peer.toString();
+        // Deliver what we've got so far
+        finishJob(&job);
+        return;
+    }
+
+    const QVector<quint32> page = operation->messages();
+    quint32 oldestId = 0;
+    for (const quint32 messageId : page) {
+        if (messageId <= job.minId) {
+            continue;
+        }
+        job.messageIds.append(messageId);
+        if (!oldestId || (messageId < oldestId)) {
+            oldestId = messageId;
+        }
+    }
+
+    const bool historyEnd = (static_cast<quint32>(page.count()) < c_pageSize) || !oldestId
+            || (oldestId <= job.minId + 1);
+    if (!historyEnd && (job.messageIds.count() >= c_maxMessagesPerDialog)) {
+        qCWarning(lcMorseChannel) << Q_FUNC_INFO << "Too many missed messages in" << job.peer.toString()
+                                  << "skip the messages from" << job.minId + 1 << "to" << oldestId - 1;
+        finishJob(&job);
+        return;
+    }
+    if (historyEnd) {
+        finishJob(&job);
+        return;
+    }
+
+    job.offsetId = oldestId;
+    fetchPage(job);
+}
+
+void MorseHistorySync::finishJob(Job *job)
+{
+    std::sort(job->messageIds.begin(), job->messageIds.end());
+    job->messageIds.erase(std::unique(job->messageIds.begin(), job->messageIds.end()), job->messageIds.end());
+    qCDebug(lcMorseChannel) << Q_FUNC_INFO << job->peer.toString() << "messages:" << job->messageIds.count();
+    emit messagesFetched(job->peer, job->messageIds);
+
+    processPendingJobs();
+}
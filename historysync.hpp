@@ -0,0 +1,85 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_HISTORYSYNC_HPP
+#define MORSE_HISTORYSYNC_HPP
+
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QVector>
+
+#include <TelegramQt/TelegramNamespace>
+
+namespace Telegram {
+
+namespace Client {
+
+class Client;
+class MessagesOperation;
+
+} // Client namespace
+
+} // Telegram namespace
+
+/**
+ * Fetches the messages missed while offline.
+ *
+ * Each dialog with unread messages is fetched page by page (newest first,
+ * down to the read inbox marker or the last message delivered to the client,
+ * whichever is newer). Several dialogs are fetched in parallel,
+ * up to the concurrency limit. The messages of a dialog are reported at once,
+ * in ascending order. messagesFetched() is emitted for every synced dialog,
+ * even with no messages, so the caller can release the messages it held back
+ * while the dialog was syncing (see isSyncing()).
+ */
+class MorseHistorySync : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MorseHistorySync(Telegram::Client::Client *client, QObject *parent = nullptr);
+
+    void start(const QVector<Telegram::Peer> &dialogs, const QHash<quint64, quint32> &deliveredMaxIds);
+    void stop();
+
+    bool isSyncing(const Telegram::Peer &peer) const;
+
+signals:
+    void messagesFetched(const Telegram::Peer peer, const QVector<quint32> &messageIds);
+
+protected:
+    struct Job {
+        Telegram::Peer peer;
+        quint32 minId = 0; // Read inbox or delivered max id, exclusive
+        quint32 offsetId = 0; // Fetch the messages older than this one (0 for the newest)
+        QVector<quint32> messageIds; // Newest first
+    };
+
+    void processPendingJobs();
+    void fetchPage(const Job &job);
+    void onPageFetched(Telegram::Client::MessagesOperation *operation, quint32 generation);
+    void finishJob(Job *job);
+
+    Telegram::Client::Client *m_client;
+    QQueue<Job> m_pendingJobs;
+    QHash<Telegram::Client::MessagesOperation*, Job> m_activeJobs;
+    quint32 m_generation = 0; // Increased on stop() to drop the replies of the stopped sync
+};
+
+#endif // MORSE_HISTORYSYNC_HPP
@@ -0,0 +1,37 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_LOGGING_HPP
+#define MORSE_LOGGING_HPP
+
+#include <QLoggingCategory>
+
+/**
+ * Logging categories of the connection manager subsystems.
+ *
+ * The debug output is compiled out if MORSE_LOG_LEVEL is above "debug"
+ * (the default for release builds). The compiled in categories can be
+ * switched at runtime via QT_LOGGING_RULES or the debug interface.
+ */
+Q_DECLARE_LOGGING_CATEGORY(lcMorseConnection)
+Q_DECLARE_LOGGING_CATEGORY(lcMorseChannel)
+Q_DECLARE_LOGGING_CATEGORY(lcMorseFiles)
+Q_DECLARE_LOGGING_CATEGORY(lcMorseAuth)
+
+#endif // MORSE_LOGGING_HPP
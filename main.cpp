@@ -18,6 +18,7 @@
 */
 
 #include <QCoreApplication>
+#include <QDebug>
 
 #include <TelepathyQt/BaseConnectionManager>
 #include <TelepathyQt/Constants>
@@ -26,6 +27,7 @@
 #include <TelegramQt/TelegramNamespace>
 
 #include "protocol.hpp"
+#include "tracing.hpp"
 
 #ifdef ENABLE_DEBUG_IFACE
 #include "debug.hpp"
@@ -45,6 +47,12 @@ int main(int argc, char *argv[])
     enableDebugInterface();
 #endif
 
+    // Trace from the very start (the roster and the unread messages are loaded on connect)
+    const QString traceFileName = QString::fromLocal8Bit(qgetenv("MORSE_TRACE_FILE"));
+    if (!traceFileName.isEmpty()) {
+        MorseTracing::recordToFile(traceFileName);
+    }
+
     Tp::BaseProtocolPtr proto = Tp::BaseProtocol::create<MorseProtocol>(QLatin1String("telegram"));
     Tp::BaseConnectionManagerPtr cm = Tp::BaseConnectionManager::create(QLatin1String("morse"));
 
@@ -0,0 +1,129 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "metrics.hpp"
+
+#include <QTextStream>
+
+// Upper bounds of the latency buckets (in microseconds); the last bucket is +Inf
+static const qint64 c_histogramBounds[] = { 100, 1000, 10000, 100000, 1000000, 10000000 };
+static const int c_histogramBucketsCount = sizeof(c_histogramBounds) / sizeof(c_histogramBounds[0]) + 1;
+
+static const char *c_counterNames[MorseMetrics::CountersCount] = {
+    "morse_messages_received_total",
+    "morse_messages_sent_total",
+    "morse_messages_send_failed_total",
+    "morse_dbus_signals_emitted_total",
+    "morse_message_received_signals_total",
+    "morse_contacts_changed_signals_total",
+    "morse_message_batches_delivered_total",
+    "morse_batched_messages_delivered_total",
+    "morse_handles_allocated_total",
+    "morse_contact_list_updates_total",
+    "morse_files_downloaded_total",
+    "morse_file_downloads_failed_total",
+    "morse_connection_status_changes_total",
+    "morse_reconnects_total",
+};
+
+static const char *c_gaugeNames[MorseMetrics::GaugesCount] = {
+    "morse_pending_downloads",
+    "morse_contact_list_size",
+};
+
+static const char *c_histogramNames[MorseMetrics::HistogramsCount] = {
+    "morse_message_ingestion_seconds",
+    "morse_message_delivery_latency_seconds",
+    "morse_message_send_seconds",
+    "morse_contact_list_update_seconds",
+    "morse_file_download_seconds",
+};
+
+struct HistogramData
+{
+    quint64 buckets[c_histogramBucketsCount];
+    quint64 count;
+    qint64 sum; // In microseconds
+};
+
+static quint64 counters[MorseMetrics::CountersCount];
+static qint64 gauges[MorseMetrics::GaugesCount];
+static HistogramData histograms[MorseMetrics::HistogramsCount];
+
+void MorseMetrics::increment(Counter counter, quint64 value)
+{
+    counters[counter] += value;
+}
+
+void MorseMetrics::setGauge(Gauge gauge, qint64 value)
+{
+    gauges[gauge] = value;
+}
+
+void MorseMetrics::addToGauge(Gauge gauge, qint64 delta)
+{
+    gauges[gauge] += delta;
+}
+
+void MorseMetrics::addSample(Histogram histogram, qint64 microseconds)
+{
+    HistogramData &data = histograms[histogram];
+    int bucket = 0;
+    while ((bucket < c_histogramBucketsCount - 1) && (microseconds > c_histogramBounds[bucket])) {
+        ++bucket;
+    }
+    ++data.buckets[bucket];
+    ++data.count;
+    data.sum += microseconds;
+}
+
+QString MorseMetrics::toText()
+{
+    QString result;
+    QTextStream stream(&result);
+
+    for (int i = 0; i < CountersCount; ++i) {
+        stream << "# TYPE " << c_counterNames[i] << " counter\n";
+        stream << c_counterNames[i] << ' ' << counters[i] << '\n';
+    }
+    for (int i = 0; i < GaugesCount; ++i) {
+        stream << "# TYPE " << c_gaugeNames[i] << " gauge\n";
+        stream << c_gaugeNames[i] << ' ' << gauges[i] << '\n';
+    }
+    for (int i = 0; i < HistogramsCount; ++i) {
+        const HistogramData &data = histograms[i];
+        stream << "# TYPE " << c_histogramNames[i] << " histogram\n";
+        quint64 cumulativeCount = 0;
+        for (int bucket = 0; bucket < c_histogramBucketsCount; ++bucket) {
+            cumulativeCount += data.buckets[bucket];
+            stream << c_histogramNames[i] << "_bucket{le=\"";
+            if (bucket < c_histogramBucketsCount - 1) {
+                stream << c_histogramBounds[bucket] / 1000000.0;
+            } else {
+                stream << "+Inf";
+            }
+            stream << "\"} " << cumulativeCount << '\n';
+        }
+        stream << c_histogramNames[i] << "_sum " << data.sum / 1000000.0 << '\n';
+        stream << c_histogramNames[i] << "_count " << data.count << '\n';
+    }
+
+    stream.flush();
+    return result;
+}
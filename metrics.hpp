@@ -0,0 +1,89 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_METRICS_HPP
+#define MORSE_METRICS_HPP
+
+#include <QElapsedTimer>
+#include <QString>
+
+/**
+ * Process wide counters, gauges and latency histograms.
+ *
+ * The values are updated from the main thread only, so the instrumentation
+ * is a plain array access. The registry is exported over D-Bus along with
+ * the debug interface, see enableDebugInterface().
+ */
+class MorseMetrics
+{
+public:
+    enum Counter {
+        MessagesReceived,
+        MessagesSent,
+        MessagesSendFailed,
+        DBusSignalsEmitted,
+        MessageReceivedSignals,
+        ContactsChangedSignals,
+        MessageBatchesDelivered, // Per peer batches of the live messages
+        BatchedMessagesDelivered, // The messages of the batches, for the mean batch size
+        HandlesAllocated,
+        ContactListUpdates,
+        FilesDownloaded,
+        FileDownloadsFailed,
+        ConnectionStatusChanges,
+        Reconnects,
+        CountersCount
+    };
+
+    enum Gauge {
+        PendingDownloads, // Queued and active
+        ContactListSize,
+        GaugesCount
+    };
+
+    enum Histogram {
+        MessageIngestionTime,
+        MessageDeliveryLatency, // From the arrival to MessageReceived of the oldest message of a batch
+        MessageSendTime,
+        ContactListUpdateTime,
+        FileDownloadTime,
+        HistogramsCount
+    };
+
+    static void increment(Counter counter, quint64 value = 1);
+    static void setGauge(Gauge gauge, qint64 value);
+    static void addToGauge(Gauge gauge, qint64 delta);
+    static void addSample(Histogram histogram, qint64 microseconds);
+
+    // Prometheus text exposition format
+    static QString toText();
+
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(Histogram histogram) : m_histogram(histogram) { m_timer.start(); }
+        ~ScopedTimer() { addSample(m_histogram, m_timer.nsecsElapsed() / 1000); }
+
+    private:
+        QElapsedTimer m_timer;
+        Histogram m_histogram;
+    };
+};
+
+#endif // MORSE_METRICS_HPP
@@ -19,6 +19,7 @@
 
 #include "protocol.hpp"
 #include "connection.hpp"
+#include "logging.hpp"
 
 #include <TelegramQt/TelegramNamespace>
 
@@ -42,11 +43,21 @@ static const QLatin1String c_proxyUsername= QLatin1String("proxy-username");
 static const QLatin1String c_proxyPassword = QLatin1String("proxy-password");
 static const QLatin1String c_keepalive = QLatin1String("keepalive");
 static const QLatin1String c_keepaliveInterval = QLatin1String("keepalive-interval");
+static const QLatin1String c_messageBatchInterval = QLatin1String("message-batch-interval");
+static const QLatin1String c_avatarCacheSize = QLatin1String("avatar-cache-size");
+static const QLatin1String c_mediaDownloadLimit = QLatin1String("media-download-limit");
+static const QLatin1String c_mediaCacheSize = QLatin1String("media-cache-size");
+static const QLatin1String c_dialogsAsContactList = QLatin1String("dialogs-as-contactlist");
+static const QLatin1String c_broadcastAsContact = QLatin1String("broadcast-as-contact");
+
+static const uint c_defaultAvatarCacheSize = 16 * 1024 * 1024;
+static const uint c_defaultMediaDownloadLimit = 0; // Opt-in
+static const uint c_defaultMediaCacheSize = 64 * 1024 * 1024;
 
 MorseProtocol::MorseProtocol(const QDBusConnection &dbusConnection, const QString &name)
     : BaseProtocol(dbusConnection, name)
 {
-    qDebug() << Q_FUNC_INFO;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO;
     setEnglishName(QLatin1String("Telegram"));
     setIconName(QLatin1String("telegram"));
     setVCardField(QLatin1String("tel"));
@@ -58,6 +69,12 @@ MorseProtocol::MorseProtocol(const QDBusConnection &dbusConnection, const QStrin
                   << Tp::ProtocolParameter(c_serverKey, QLatin1String("s"), Tp::ConnMgrParamFlagHasDefault, QString())
                   << Tp::ProtocolParameter(c_keepalive, QLatin1String("b"), Tp::ConnMgrParamFlagHasDefault, true)
                   << Tp::ProtocolParameter(c_keepaliveInterval, QLatin1String("u"), Tp::ConnMgrParamFlagHasDefault, 15)
+                  << Tp::ProtocolParameter(c_messageBatchInterval, QLatin1String("u"), Tp::ConnMgrParamFlagHasDefault, 0) // In milliseconds
+                  << Tp::ProtocolParameter(c_avatarCacheSize, QLatin1String("u"), Tp::ConnMgrParamFlagHasDefault, c_defaultAvatarCacheSize) // In bytes
+                  << Tp::ProtocolParameter(c_mediaDownloadLimit, QLatin1String("u"), Tp::ConnMgrParamFlagHasDefault, c_defaultMediaDownloadLimit) // In bytes, 0 to disable
+                  << Tp::ProtocolParameter(c_mediaCacheSize, QLatin1String("u"), Tp::ConnMgrParamFlagHasDefault, c_defaultMediaCacheSize) // In bytes
+                  << Tp::ProtocolParameter(c_dialogsAsContactList, QLatin1String("b"), Tp::ConnMgrParamFlagHasDefault, true)
+                  << Tp::ProtocolParameter(c_broadcastAsContact, QLatin1String("b"), Tp::ConnMgrParamFlagHasDefault, false)
                   << Tp::ProtocolParameter(c_proxyType, QLatin1String("s"), 0) // ATM we have only socks5 support, but Telegram supports http-proxy too
                   << Tp::ProtocolParameter(c_proxyAddress, QLatin1String("s"), 0)
                   << Tp::ProtocolParameter(c_proxyPort, QLatin1String("u"), 0)
@@ -142,9 +159,39 @@ uint MorseProtocol::getKeepAliveInterval(const QVariantMap &parameters, uint def
     return parameters.value(c_keepaliveInterval, defaultValue).toUInt();
 }
 
+uint MorseProtocol::getMessageBatchInterval(const QVariantMap &parameters)
+{
+    return parameters.value(c_messageBatchInterval, 0u).toUInt();
+}
+
+uint MorseProtocol::getAvatarCacheSize(const QVariantMap &parameters)
+{
+    return parameters.value(c_avatarCacheSize, c_defaultAvatarCacheSize).toUInt();
+}
+
+uint MorseProtocol::getMediaDownloadLimit(const QVariantMap &parameters)
+{
+    return parameters.value(c_mediaDownloadLimit, c_defaultMediaDownloadLimit).toUInt();
+}
+
+uint MorseProtocol::getMediaCacheSize(const QVariantMap &parameters)
+{
+    return parameters.value(c_mediaCacheSize, c_defaultMediaCacheSize).toUInt();
+}
+
+bool MorseProtocol::getDialogsAsContactList(const QVariantMap &parameters)
+{
+    return parameters.value(c_dialogsAsContactList, true).toBool();
+}
+
+bool MorseProtocol::getBroadcastAsContact(const QVariantMap &parameters)
+{
+    return parameters.value(c_broadcastAsContact, false).toBool();
+}
+
 Tp::BaseConnectionPtr MorseProtocol::createConnection(const QVariantMap &parameters, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << Telegram::Utils::maskPhoneNumber(parameters, c_account);
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << Telegram::Utils::maskPhoneNumber(parameters, c_account);
     Q_UNUSED(error)
 
     Tp::BaseConnectionPtr newConnection = Tp::BaseConnection::create<MorseConnection>(QLatin1String("morse"), name(), parameters);
@@ -154,14 +201,14 @@ Tp::BaseConnectionPtr MorseProtocol::createConnection(const QVariantMap &paramet
 
 QString MorseProtocol::identifyAccount(const QVariantMap &parameters, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << parameters;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << parameters;
     error->set(QLatin1String("IdentifyAccount.Error.NotImplemented"), QLatin1String(""));
     return QString();
 }
 
 QString MorseProtocol::normalizeContact(const QString &contactId, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << contactId;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << contactId;
     error->set(QLatin1String("NormalizeContact.Error.NotImplemented"), QLatin1String(""));
     return QString();
 }
@@ -169,14 +216,14 @@ QString MorseProtocol::normalizeContact(const QString &contactId, Tp::DBusError
 QString MorseProtocol::normalizeVCardAddress(const QString &vcardField, const QString vcardAddress,
         Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << vcardField << vcardAddress;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << vcardField << vcardAddress;
     error->set(QLatin1String("NormalizeVCardAddress.Error.NotImplemented"), QLatin1String(""));
     return QString();
 }
 
 QString MorseProtocol::normalizeContactUri(const QString &uri, Tp::DBusError *error)
 {
-    qDebug() << Q_FUNC_INFO << uri;
+    qCDebug(lcMorseConnection) << Q_FUNC_INFO << uri;
     error->set(QLatin1String("NormalizeContactUri.Error.NotImplemented"), QLatin1String(""));
     return QString();
 }
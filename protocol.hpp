@@ -41,6 +41,12 @@ public:
     static QString getProxyUsername(const QVariantMap &parameters);
     static QString getProxyPassword(const QVariantMap &parameters);
     static uint getKeepAliveInterval(const QVariantMap &parameters, uint defaultValue);
+    static uint getMessageBatchInterval(const QVariantMap &parameters);
+    static uint getAvatarCacheSize(const QVariantMap &parameters);
+    static uint getMediaDownloadLimit(const QVariantMap &parameters);
+    static uint getMediaCacheSize(const QVariantMap &parameters);
+    static bool getDialogsAsContactList(const QVariantMap &parameters);
+    static bool getBroadcastAsContact(const QVariantMap &parameters);
 
 private:
     Tp::BaseConnectionPtr createConnection(const QVariantMap &parameters, Tp::DBusError *error);
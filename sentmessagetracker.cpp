@@ -0,0 +1,95 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include "sentmessagetracker.hpp"
+
+void MorseSentMessageTracker::setMaximumCount(int count)
+{
+    m_maximumCount = qMax(1, count);
+    evict();
+}
+
+void MorseSentMessageTracker::addMessage(quint64 randomId)
+{
+    if (m_ids.contains(randomId)) {
+        return;
+    }
+    m_ids.insert(randomId, 0);
+    m_order.enqueue(randomId);
+    evict();
+}
+
+bool MorseSentMessageTracker::setMessageId(quint64 randomId, quint32 messageId)
+{
+    QHash<quint64, quint32>::iterator it = m_ids.find(randomId);
+    if (it == m_ids.end()) {
+        return false;
+    }
+    if (it.value()) {
+        m_randomIds.remove(it.value());
+    }
+    it.value() = messageId;
+    m_randomIds.insert(messageId, randomId);
+    return true;
+}
+
+/**
+ * Remove the sent messages with id up to \a messageId (inclusive) and return
+ * their random ids in order of the message ids.
+ */
+QVector<quint64> MorseSentMessageTracker::takeMessagesUpTo(quint32 messageId)
+{
+    QVector<quint64> result;
+    QMap<quint32, quint64>::iterator it = m_randomIds.begin();
+    while ((it != m_randomIds.end()) && (it.key() <= messageId)) {
+        result.append(it.value());
+        m_ids.remove(it.value());
+        it = m_randomIds.erase(it);
+    }
+
+    // Drop the stale ids from the order queue once they dominate it
+    if (m_order.count() > m_ids.count() * 2) {
+        QQueue<quint64> order;
+        for (const quint64 randomId : m_order) {
+            if (m_ids.contains(randomId)) {
+                order.enqueue(randomId);
+            }
+        }
+        m_order = order;
+    }
+
+    return result;
+}
+
+void MorseSentMessageTracker::evict()
+{
+    while ((m_ids.count() > m_maximumCount) && !m_order.isEmpty()) {
+        const quint64 randomId = m_order.dequeue();
+        QHash<quint64, quint32>::iterator it = m_ids.find(randomId);
+        if (it == m_ids.end()) {
+            // Already read
+            continue;
+        }
+        if (it.value()) {
+            m_randomIds.remove(it.value());
+        }
+        m_ids.erase(it);
+    }
+}
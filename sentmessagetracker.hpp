@@ -0,0 +1,57 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_SENTMESSAGETRACKER_HPP
+#define MORSE_SENTMESSAGETRACKER_HPP
+
+#include <QHash>
+#include <QMap>
+#include <QQueue>
+#include <QVector>
+
+/**
+ * Outgoing messages of a channel, indexed both by the random id (the Telepathy
+ * message token) and by the server message id, once it is known.
+ *
+ * Messages are forgotten once they are read by the recipient; the total number
+ * of tracked messages is limited and the oldest messages are evicted first.
+ */
+class MorseSentMessageTracker
+{
+public:
+    int count() const { return m_ids.count(); }
+
+    int maximumCount() const { return m_maximumCount; }
+    void setMaximumCount(int count);
+
+    void addMessage(quint64 randomId);
+    bool setMessageId(quint64 randomId, quint32 messageId);
+
+    QVector<quint64> takeMessagesUpTo(quint32 messageId);
+
+private:
+    void evict();
+
+    QHash<quint64, quint32> m_ids; // Random id to message id (0 until the message is sent)
+    QMap<quint32, quint64> m_randomIds; // Message id to random id
+    QQueue<quint64> m_order; // Random ids in order of sending; may contain already removed ids
+    int m_maximumCount = 1024;
+};
+
+#endif // MORSE_SENTMESSAGETRACKER_HPP
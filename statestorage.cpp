@@ -0,0 +1,223 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "statestorage.hpp"
+#include "handleregistry.hpp"
+#include "logging.hpp"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+static const quint32 c_stateMagic = 0x4d525331; // "MRS1"
+static const quint32 c_stateVersion = 1;
+static const QDataStream::Version c_streamVersion = QDataStream::Qt_5_0;
+
+// Do not rewrite small logs, the overhead is negligible
+static const int c_minCompactionRecords = 256;
+
+static void writeHeader(QDataStream *stream)
+{
+    *stream << c_stateMagic << c_stateVersion;
+}
+
+void MorseStateStorage::setFileName(const QString &fileName)
+{
+    m_fileName = fileName;
+}
+
+bool MorseStateStorage::load()
+{
+    m_contacts.clear();
+    m_pendingRecords.clear();
+    m_recordsCount = 0;
+
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(c_streamVersion);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    stream >> magic >> version;
+    if ((magic != c_stateMagic) || (version != c_stateVersion)) {
+        qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Unsupported state file" << m_fileName;
+        file.close();
+        // Start over, otherwise the new records would be appended to the foreign data
+        compact();
+        return false;
+    }
+
+    bool corrupted = false;
+    while (!stream.atEnd()) {
+        quint8 type = 0;
+        quint8 peerType = 0;
+        quint32 peerId = 0;
+        QString alias;
+        stream >> type >> peerType >> peerId;
+        if (type == RecordSetContact) {
+            stream >> alias;
+        }
+        if (stream.status() != QDataStream::Ok) {
+            corrupted = true;
+            break;
+        }
+
+        Telegram::Peer peer;
+        peer.type = static_cast<Telegram::Peer::Type>(peerType);
+        peer.id = peerId;
+
+        if (type == RecordSetContact) {
+            ContactEntry entry;
+            entry.peer = peer;
+            entry.alias = alias;
+            m_contacts.insert(MorseHandleRegistry::peerKey(peer), entry);
+        } else if (type == RecordRemoveContact) {
+            m_contacts.remove(MorseHandleRegistry::peerKey(peer));
+        } else {
+            corrupted = true;
+            break;
+        }
+        ++m_recordsCount;
+    }
+    file.close();
+
+    if (corrupted) {
+        // Most likely the process was killed in the middle of a write; keep what we've got
+        qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Dropped the broken tail of the state file" << m_fileName;
+        compact();
+    }
+
+    return true;
+}
+
+bool MorseStateStorage::flush()
+{
+    if (m_pendingRecords.isEmpty()) {
+        return true;
+    }
+
+    if ((m_recordsCount > c_minCompactionRecords) && (m_recordsCount > m_contacts.count() * 2)) {
+        return compact();
+    }
+
+    QDir().mkpath(QFileInfo(m_fileName).absolutePath());
+
+    QFile file(m_fileName);
+    const bool newFile = !file.exists() || (file.size() == 0);
+    if (!file.open(QIODevice::WriteOnly|QIODevice::Append)) {
+        qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Unable to open the state file" << m_fileName << file.errorString();
+        return false;
+    }
+
+    if (newFile) {
+        QDataStream stream(&file);
+        stream.setVersion(c_streamVersion);
+        writeHeader(&stream);
+    }
+
+    file.write(m_pendingRecords);
+    m_pendingRecords.clear();
+    return true;
+}
+
+QVector<Telegram::Peer> MorseStateStorage::contactList() const
+{
+    QVector<Telegram::Peer> result;
+    result.reserve(m_contacts.count());
+    for (const ContactEntry &entry : m_contacts) {
+        result.append(entry.peer);
+    }
+    return result;
+}
+
+QString MorseStateStorage::alias(const Telegram::Peer &peer) const
+{
+    return m_contacts.value(MorseHandleRegistry::peerKey(peer)).alias;
+}
+
+void MorseStateStorage::setContact(const Telegram::Peer &peer, const QString &alias)
+{
+    const quint64 key = MorseHandleRegistry::peerKey(peer);
+    QHash<quint64, ContactEntry>::iterator it = m_contacts.find(key);
+    if (it != m_contacts.end()) {
+        if (it->alias == alias) {
+            return;
+        }
+        it->alias = alias;
+    } else {
+        ContactEntry entry;
+        entry.peer = peer;
+        entry.alias = alias;
+        m_contacts.insert(key, entry);
+    }
+    appendRecord(RecordSetContact, peer, alias);
+}
+
+void MorseStateStorage::removeContact(const Telegram::Peer &peer)
+{
+    if (!m_contacts.remove(MorseHandleRegistry::peerKey(peer))) {
+        return;
+    }
+    appendRecord(RecordRemoveContact, peer);
+}
+
+void MorseStateStorage::appendRecord(RecordType type, const Telegram::Peer &peer, const QString &alias)
+{
+    QDataStream stream(&m_pendingRecords, QIODevice::WriteOnly|QIODevice::Append);
+    stream.setVersion(c_streamVersion);
+    stream << static_cast<quint8>(type) << static_cast<quint8>(peer.type) << peer.id;
+    if (type == RecordSetContact) {
+        stream << alias;
+    }
+    ++m_recordsCount;
+}
+
+bool MorseStateStorage::compact()
+{
+    QDir().mkpath(QFileInfo(m_fileName).absolutePath());
+
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Unable to open the state file" << m_fileName << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(c_streamVersion);
+    writeHeader(&stream);
+    for (const ContactEntry &entry : m_contacts) {
+        stream << static_cast<quint8>(RecordSetContact) << static_cast<quint8>(entry.peer.type) << entry.peer.id << entry.alias;
+    }
+
+    if (!file.commit()) {
+        qCWarning(lcMorseConnection) << Q_FUNC_INFO << "Unable to write the state file" << m_fileName << file.errorString();
+        return false;
+    }
+
+    m_pendingRecords.clear();
+    m_recordsCount = m_contacts.count();
+    return true;
+}
@@ -0,0 +1,72 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_STATESTORAGE_HPP
+#define MORSE_STATESTORAGE_HPP
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <TelegramQt/TelegramNamespace>
+
+/**
+ * Persistent roster state of an account.
+ *
+ * The state is stored as an append-only binary log of contact records.
+ * Changes are accumulated in memory and appended to the file on flush();
+ * the log is rewritten from scratch once it grows well beyond the live data.
+ */
+class MorseStateStorage
+{
+public:
+    QString fileName() const { return m_fileName; }
+    void setFileName(const QString &fileName);
+
+    bool load();
+    bool flush();
+
+    QVector<Telegram::Peer> contactList() const;
+    QString alias(const Telegram::Peer &peer) const;
+
+    void setContact(const Telegram::Peer &peer, const QString &alias);
+    void removeContact(const Telegram::Peer &peer);
+
+private:
+    enum RecordType : quint8 {
+        RecordSetContact = 1,
+        RecordRemoveContact = 2,
+    };
+
+    struct ContactEntry {
+        Telegram::Peer peer;
+        QString alias;
+    };
+
+    void appendRecord(RecordType type, const Telegram::Peer &peer, const QString &alias = QString());
+    bool compact();
+
+    QString m_fileName;
+    QHash<quint64, ContactEntry> m_contacts;
+    QByteArray m_pendingRecords;
+    int m_recordsCount = 0;
+};
+
+#endif // MORSE_STATESTORAGE_HPP
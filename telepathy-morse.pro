@@ -11,15 +11,34 @@ PKGCONFIG += TelepathyQt5
 PKGCONFIG += TelepathyQt5Service
 PKGCONFIG += TelegramQt5
 
+# Compile out the debug output of release builds
+CONFIG(release, debug|release): DEFINES += QT_NO_DEBUG_OUTPUT
+
 SOURCES = main.cpp \
     connection.cpp \
+    filecache.cpp \
+    handleregistry.cpp \
+    historysync.cpp \
+    logging.cpp \
+    metrics.cpp \
     protocol.cpp \
-    textchannel.cpp
+    sentmessagetracker.cpp \
+    statestorage.cpp \
+    textchannel.cpp \
+    tracing.cpp
 
 HEADERS = \
     connection.hpp \
+    filecache.hpp \
+    handleregistry.hpp \
+    historysync.hpp \
+    logging.hpp \
+    metrics.hpp \
     protocol.hpp \
-    textchannel.hpp
+    sentmessagetracker.hpp \
+    statestorage.hpp \
+    textchannel.hpp \
+    tracing.hpp
 
 OTHER_FILES += CMakeLists.txt
 OTHER_FILES += rpm/telepathy-morse.spec
@@ -0,0 +1,178 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "fakeclient.hpp"
+#include "connection.hpp"
+#include "textchannel.hpp"
+
+#include <TelegramQt/Client>
+#include <TelegramQt/MessagingApi>
+
+// TelegramQt private headers (see TELEGRAM_QT5_PRIVATE_INCLUDE_DIR)
+#include "DataStorage_p.hpp"
+#include "TLTypes.hpp"
+
+static const quint32 c_selfUserId = 2000000000; // Out of the contact ids range
+static const quint32 c_firstMessageDate = 1500000000;
+
+static Telegram::Client::DataInternalApi *dataApi(MorseConnection *connection)
+{
+    return Telegram::Client::DataInternalApi::get(connection->core()->dataStorage());
+}
+
+static TLPeer toTLPeer(const Telegram::Peer &peer)
+{
+    TLPeer result;
+    result.tlType = TLValue::PeerUser;
+    result.userId = peer.id;
+    return result;
+}
+
+MorseFakeClient::MorseFakeClient(MorseConnection *connection) :
+    m_connection(connection)
+{
+}
+
+void MorseFakeClient::populate(int contactsCount, int messagesPerContact)
+{
+    addUser(c_selfUserId);
+
+    TLMessagesDialogs dialogs;
+    dialogs.tlType = TLValue::MessagesDialogs;
+    m_contacts.reserve(m_contacts.count() + contactsCount);
+    for (int i = 0; i < contactsCount; ++i) {
+        const Telegram::Peer peer = Telegram::Peer::fromUserId(static_cast<quint32>(m_contacts.count() + 1));
+        addUser(peer.id);
+        m_contacts.append(peer);
+
+        const QVector<quint32> messageIds = addIncomingMessages(peer, messagesPerContact);
+
+        TLDialog dialog;
+        dialog.tlType = TLValue::Dialog;
+        dialog.peer = toTLPeer(peer);
+        dialog.topMessage = messageIds.isEmpty() ? 0 : messageIds.last();
+        // Read already, so the history sync has nothing to do
+        dialog.readInboxMaxId = dialog.topMessage;
+        dialog.unreadCount = 0;
+        dialogs.dialogs.append(dialog);
+    }
+    dataApi(m_connection)->processData(dialogs);
+
+    m_contactList = m_contacts;
+}
+
+MorseTextChannel *MorseFakeClient::textChannel(const Telegram::Peer &peer) const
+{
+    return m_connection->getTextChannel(peer);
+}
+
+/* The connection state after the sign in (the self contact and the status), without the server */
+void MorseFakeClient::setConnected()
+{
+    const Telegram::Peer selfPeer = Telegram::Peer::fromUserId(c_selfUserId);
+    m_connection->m_contactHandles.setPeer(m_connection->selfHandle(), selfPeer);
+    m_connection->setSelfContact(m_connection->selfHandle(), selfPeer.toString());
+    m_connection->setStatus(Tp::ConnectionStatusConnected, Tp::ConnectionStatusReasonRequested);
+    m_connection->updateSelfContactState(Tp::ConnectionStatusConnected);
+}
+
+/* The roster load of MorseConnection::updateContactList() */
+void MorseFakeClient::loadContactList()
+{
+    m_connection->processContactList(m_contactList);
+}
+
+/* Removes the contact from the roster (or adds it back) and loads the roster */
+void MorseFakeClient::toggleContact(const Telegram::Peer &peer)
+{
+    const int index = m_contactList.indexOf(peer);
+    if (index < 0) {
+        m_contactList.append(peer);
+    } else {
+        m_contactList.remove(index);
+    }
+    loadContactList();
+}
+
+/* As on the connection start, see MorseConnection::getContactAttributes() */
+void MorseFakeClient::clearContactAttributesCache()
+{
+    m_connection->m_contactAttributesCache.clear();
+}
+
+QVector<quint32> MorseFakeClient::addIncomingMessages(const Telegram::Peer &peer, int count)
+{
+    QVector<quint32> messageIds;
+    messageIds.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        messageIds.append(addIncomingMessage(peer, QStringLiteral("Synthetic message %1").arg(m_lastMessageId + 1)));
+    }
+    return messageIds;
+}
+
+quint32 MorseFakeClient::addIncomingMessage(const Telegram::Peer &peer, const QString &text)
+{
+    TLMessage message;
+    message.tlType = TLValue::Message;
+    message.flags = TLMessage::FromId;
+    message.id = ++m_lastMessageId;
+    message.fromId = peer.id;
+    message.toId = toTLPeer(Telegram::Peer::fromUserId(c_selfUserId));
+    message.date = c_firstMessageDate + ++m_lastMessageDate;
+    message.message = text;
+    dataApi(m_connection)->processData(message);
+    return message.id;
+}
+
+void MorseFakeClient::receiveMessage(const Telegram::Peer &peer, const QString &text)
+{
+    const quint32 messageId = addIncomingMessage(peer, text);
+    emit m_connection->core()->messagingApi()->messageReceived(peer, messageId);
+}
+
+/* Delivers the messages batched by MorseConnection::onNewMessageReceived() without waiting for the timer */
+void MorseFakeClient::deliverPendingMessages()
+{
+    m_connection->deliverPendingMessages();
+}
+
+void MorseFakeClient::setTyping(const Telegram::Peer &peer, bool typing)
+{
+    const TelegramNamespace::MessageAction action = typing ? TelegramNamespace::MessageActionTyping
+                                                           : TelegramNamespace::MessageActionNone;
+    emit m_connection->core()->messagingApi()->messageActionChanged(peer, peer.id, action);
+}
+
+void MorseFakeClient::addUser(quint32 userId)
+{
+    TLUser user;
+    user.tlType = TLValue::User;
+    user.flags = TLUser::FirstName|TLUser::LastName|TLUser::Phone|TLUser::AccessHash;
+    if (userId == c_selfUserId) {
+        user.flags |= TLUser::Self;
+    } else {
+        user.flags |= TLUser::Contact;
+    }
+    user.id = userId;
+    user.accessHash = userId;
+    user.firstName = QStringLiteral("User");
+    user.lastName = QString::number(userId);
+    user.phone = QStringLiteral("+9996%1").arg(userId, 6, 10, QLatin1Char('0'));
+    dataApi(m_connection)->processData(user);
+}
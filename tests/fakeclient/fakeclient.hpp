@@ -0,0 +1,74 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_FAKECLIENT_HPP
+#define MORSE_FAKECLIENT_HPP
+
+#include <QVector>
+
+#include <TelegramQt/TelegramNamespace>
+
+class MorseConnection;
+class MorseTextChannel;
+
+/**
+ * Stands in for the Telegram server behind a MorseConnection.
+ *
+ * The data storage of the connection client is filled with synthetic users,
+ * dialogs and messages (via the TelegramQt internal data API, so the storage
+ * getters used by the connection work as usual), and the client signals
+ * are emitted as on the server updates. No network is involved.
+ *
+ * The contacts are the users with ids from 1 to the populated count.
+ */
+class MorseFakeClient
+{
+public:
+    explicit MorseFakeClient(MorseConnection *connection);
+
+    MorseConnection *connection() const { return m_connection; }
+
+    void populate(int contactsCount, int messagesPerContact);
+    QVector<Telegram::Peer> contacts() const { return m_contacts; }
+    MorseTextChannel *textChannel(const Telegram::Peer &peer) const;
+    void setConnected();
+
+    /* Roster */
+    void loadContactList();
+    void toggleContact(const Telegram::Peer &peer);
+    void clearContactAttributesCache();
+
+    /* Messages; the add*() functions only store them, receive*() report them as the live updates do */
+    QVector<quint32> addIncomingMessages(const Telegram::Peer &peer, int count);
+    quint32 addIncomingMessage(const Telegram::Peer &peer, const QString &text);
+    void receiveMessage(const Telegram::Peer &peer, const QString &text);
+    void deliverPendingMessages();
+    void setTyping(const Telegram::Peer &peer, bool typing);
+
+private:
+    void addUser(quint32 userId);
+
+    MorseConnection *m_connection;
+    QVector<Telegram::Peer> m_contacts;
+    QVector<Telegram::Peer> m_contactList; // The current roster, see toggleContact()
+    quint32 m_lastMessageId = 0; // The private chat message ids are per account
+    quint32 m_lastMessageDate = 0;
+};
+
+#endif // MORSE_FAKECLIENT_HPP
@@ -0,0 +1,802 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * End-to-end load generator.
+ *
+ * Starts a private D-Bus daemon and the connection manager on it, connects an account
+ * (a local test server can be passed via the server-* options), sends messages and typing
+ * events through the Telepathy D-Bus API and counts the MessageReceived and ContactsChanged
+ * signals as seen by a client. The CM side latencies are taken from the metrics object.
+ * The results are printed as JSON.
+ *
+ * With --stub the telepathy-morse-stub connection manager is started instead: it needs
+ * no server and no account, and the incoming messages, typing events and roster changes
+ * are injected at the given rate via its stub object. The latency of each injected event
+ * is measured from the injection call to the corresponding client signal
+ * (MessageReceived, ChatStateChanged and ContactsChanged).
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusMetaType>
+#include <QDBusObjectPath>
+#include <QDBusPendingCallWatcher>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QQueue>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QTimer>
+
+#include <algorithm>
+#include <functional>
+
+static const QString c_cmService = QStringLiteral("org.freedesktop.Telepathy.ConnectionManager.morse");
+static const QString c_cmPath = QStringLiteral("/org/freedesktop/Telepathy/ConnectionManager/morse");
+static const QString c_cmInterface = QStringLiteral("org.freedesktop.Telepathy.ConnectionManager");
+static const QString c_connectionInterface = QStringLiteral("org.freedesktop.Telepathy.Connection");
+static const QString c_requestsInterface = QStringLiteral("org.freedesktop.Telepathy.Connection.Interface.Requests");
+static const QString c_contactListInterface = QStringLiteral("org.freedesktop.Telepathy.Connection.Interface.ContactList");
+static const QString c_channelInterface = QStringLiteral("org.freedesktop.Telepathy.Channel");
+static const QString c_messagesInterface = QStringLiteral("org.freedesktop.Telepathy.Channel.Interface.Messages");
+static const QString c_chatStateInterface = QStringLiteral("org.freedesktop.Telepathy.Channel.Interface.ChatState");
+static const QString c_metricsPath = QStringLiteral("/org/freedesktop/Telepathy/debug/metrics");
+static const QString c_metricsInterface = QStringLiteral("org.freedesktop.Telepathy.ConnectionManager.morse.Metrics");
+static const QString c_stubPath = QStringLiteral("/org/freedesktop/Telepathy/debug/stub");
+static const QString c_stubInterface = QStringLiteral("org.freedesktop.Telepathy.ConnectionManager.morse.Stub");
+static const QString c_injectedMessagePrefix = QStringLiteral("Injected message ");
+
+static const uint c_statusConnected = 0;
+static const uint c_statusDisconnected = 2;
+static const uint c_chatStateActive = 2;
+static const uint c_chatStateComposing = 4;
+static const uint c_messageTypeDeliveryReport = 4;
+
+static const int c_startTimeout = 10000; // In milliseconds
+static const int c_callTimeout = 30000;
+static const int c_maxInjectionInterval = 100;
+
+typedef QList<QVariantMap> MessagePartList;
+
+struct LoadOptions
+{
+    QString cmBinary;
+    QString cmLogFile;
+    QVariantMap parameters;
+    QString peer;
+    int messages = 1000;
+    int typingEvents = 1000;
+    int concurrency = 16;
+    int duration = 30; // In seconds
+    QString metricsFile;
+    double maxSendLatency = 0; // In milliseconds, 0 to not check
+    int minReceived = 0;
+
+    // The stub connection manager
+    bool stub = false;
+    int stubContacts = 100;
+    int incomingMessages = 1000;
+    int incomingPeers = 1;
+    int incomingTyping = 1000;
+    int rosterChanges = 100;
+    int injectionRate = 200; // Events per second
+    double maxReceiveLatency = 0; // In milliseconds, 0 to not check
+};
+
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LoadGenerator(const LoadOptions &options, QObject *parent = nullptr);
+    ~LoadGenerator();
+
+    bool start(QString *error);
+    void run();
+
+signals:
+    void finished(int result);
+
+private slots:
+    void onStatusChanged(uint status, uint reason);
+    void onMessageReceived(const QDBusMessage &message);
+    void onContactsChanged(const QDBusMessage &message);
+    void onChatStateChanged(uint contact, uint state);
+    void onSendFinished(QDBusPendingCallWatcher *watcher);
+    void onDurationElapsed();
+    void injectNext();
+
+private:
+    bool waitFor(const std::function<bool()> &condition, int timeout);
+    QDBusMessage call(const QString &service, const QString &path, const QString &interface,
+                      const QString &method, const QVariantList &arguments, QString *error);
+    QHash<QString, double> getMetrics();
+    void sendNext();
+    void inject(const QString &method, const QVariantList &arguments);
+    bool isInjectionFinished() const;
+    void checkFinished();
+    void finish();
+    void stop();
+
+    LoadOptions m_options;
+    QProcess m_busProcess;
+    QProcess m_cmProcess;
+    QTemporaryDir m_dataDir;
+    QDBusConnection m_bus;
+    QString m_connectionService;
+    QString m_connectionPath;
+    QString m_channelPath;
+    uint m_status = c_statusDisconnected;
+
+    QHash<QString, double> m_initialMetrics;
+    QElapsedTimer m_runTimer;
+    QHash<QDBusPendingCallWatcher*, qint64> m_pendingSends; // Watcher to the start time (in nanoseconds)
+    QVector<double> m_sendLatencies; // In milliseconds
+    int m_messagesSent = 0;
+    int m_sendErrors = 0;
+    int m_typingEventsSent = 0;
+    int m_messageReceivedSignals = 0;
+    int m_receivedMessages = 0;
+    int m_contactsChangedSignals = 0;
+    bool m_durationElapsed = false;
+    bool m_finished = false;
+
+    QTimer m_injectionTimer;
+    int m_injectedEvents = 0;
+    int m_nextEventKind = 0;
+    int m_injectedMessages = 0;
+    int m_injectedTypingEvents = 0;
+    int m_injectedRosterChanges = 0;
+    int m_injectionErrors = 0;
+    // The injection times (in nanoseconds); the messages are matched by the text,
+    // the typing events and the roster changes come in the injection order
+    QHash<int, qint64> m_pendingMessages;
+    QQueue<qint64> m_pendingTypingEvents;
+    QQueue<qint64> m_pendingRosterChanges;
+    QVector<double> m_messageLatencies; // In milliseconds
+    QVector<double> m_typingLatencies;
+    QVector<double> m_rosterLatencies;
+};
+
+LoadGenerator::LoadGenerator(const LoadOptions &options, QObject *parent) :
+    QObject(parent),
+    m_options(options),
+    m_bus(QStringLiteral("morse-load"))
+{
+    m_injectionTimer.setInterval(qBound(1, 1000 / qMax(1, m_options.injectionRate), c_maxInjectionInterval));
+    connect(&m_injectionTimer, &QTimer::timeout, this, &LoadGenerator::injectNext);
+}
+
+LoadGenerator::~LoadGenerator()
+{
+    stop();
+}
+
+bool LoadGenerator::start(QString *error)
+{
+    // The private bus keeps the measurements isolated from the desktop session
+    m_busProcess.start(QStringLiteral("dbus-daemon"), QStringList()
+                       << QStringLiteral("--session") << QStringLiteral("--nofork") << QStringLiteral("--print-address"));
+    if (!m_busProcess.waitForStarted() || !m_busProcess.waitForReadyRead(c_startTimeout)) {
+        *error = QStringLiteral("Unable to start dbus-daemon: ") + m_busProcess.errorString();
+        return false;
+    }
+    const QString address = QString::fromLocal8Bit(m_busProcess.readLine().trimmed());
+    m_bus = QDBusConnection::connectToBus(address, QStringLiteral("morse-load"));
+    if (!m_bus.isConnected()) {
+        *error = QStringLiteral("Unable to connect to the private bus ") + address;
+        return false;
+    }
+
+    m_bus.connect(QString(), QString(), c_connectionInterface, QStringLiteral("StatusChanged"),
+                  this, SLOT(onStatusChanged(uint,uint)));
+    m_bus.connect(QString(), QString(), c_messagesInterface, QStringLiteral("MessageReceived"),
+                  this, SLOT(onMessageReceived(QDBusMessage)));
+    m_bus.connect(QString(), QString(), c_contactListInterface, QStringLiteral("ContactsChanged"),
+                  this, SLOT(onContactsChanged(QDBusMessage)));
+    m_bus.connect(QString(), QString(), c_chatStateInterface, QStringLiteral("ChatStateChanged"),
+                  this, SLOT(onChatStateChanged(uint,uint)));
+
+    QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+    environment.insert(QStringLiteral("DBUS_SESSION_BUS_ADDRESS"), address);
+    if (m_options.stub) {
+        // The synthetic account data must not mix with a real one
+        environment.insert(QStringLiteral("XDG_DATA_HOME"), m_dataDir.path());
+        environment.insert(QStringLiteral("MORSE_STUB_CONTACTS"), QString::number(m_options.stubContacts));
+    }
+    m_cmProcess.setProcessEnvironment(environment);
+    m_cmProcess.setStandardOutputFile(QProcess::nullDevice());
+    m_cmProcess.setStandardErrorFile(m_options.cmLogFile.isEmpty() ? QProcess::nullDevice() : m_options.cmLogFile);
+    m_cmProcess.start(m_options.cmBinary, QStringList());
+    if (!m_cmProcess.waitForStarted()) {
+        *error = QStringLiteral("Unable to start ") + m_options.cmBinary + QStringLiteral(": ") + m_cmProcess.errorString();
+        return false;
+    }
+    if (!waitFor([this]() { return m_bus.interface()->isServiceRegistered(c_cmService).value(); }, c_startTimeout)) {
+        *error = QStringLiteral("The connection manager has not appeared on the bus");
+        return false;
+    }
+
+    const QDBusMessage connection = call(c_cmService, c_cmPath, c_cmInterface, QStringLiteral("RequestConnection"),
+                                         QVariantList() << QStringLiteral("telegram") << m_options.parameters, error);
+    if (connection.type() != QDBusMessage::ReplyMessage) {
+        return false;
+    }
+    m_connectionService = connection.arguments().at(0).toString();
+    m_connectionPath = connection.arguments().at(1).value<QDBusObjectPath>().path();
+
+    if (call(m_connectionService, m_connectionPath, c_connectionInterface, QStringLiteral("Connect"),
+             QVariantList(), error).type() != QDBusMessage::ReplyMessage) {
+        return false;
+    }
+    if (!waitFor([this]() { return m_status == c_statusConnected; }, c_callTimeout * 2)) {
+        *error = QStringLiteral("Unable to connect the account (it has to be authorized already)");
+        return false;
+    }
+
+    if (!m_options.peer.isEmpty()) {
+        QVariantMap request;
+        request.insert(c_channelInterface + QStringLiteral(".ChannelType"), QStringLiteral("org.freedesktop.Telepathy.Channel.Type.Text"));
+        request.insert(c_channelInterface + QStringLiteral(".TargetHandleType"), 1u); // Contact
+        request.insert(c_channelInterface + QStringLiteral(".TargetID"), m_options.peer);
+        const QDBusMessage channel = call(m_connectionService, m_connectionPath, c_requestsInterface,
+                                          QStringLiteral("EnsureChannel"), QVariantList() << request, error);
+        if (channel.type() != QDBusMessage::ReplyMessage) {
+            return false;
+        }
+        m_channelPath = channel.arguments().at(1).value<QDBusObjectPath>().path();
+    }
+
+    // The initial roster and the unread messages are not a part of the measurement
+    m_messageReceivedSignals = 0;
+    m_receivedMessages = 0;
+    m_contactsChangedSignals = 0;
+    m_initialMetrics = getMetrics();
+    return true;
+}
+
+void LoadGenerator::run()
+{
+    m_runTimer.start();
+    QTimer::singleShot(m_options.duration * 1000, this, SLOT(onDurationElapsed()));
+
+    if (m_options.stub) {
+        m_injectionTimer.start();
+    }
+    if (m_channelPath.isEmpty()) {
+        return;
+    }
+    for (int i = 0; i < m_options.concurrency; ++i) {
+        sendNext();
+    }
+}
+
+void LoadGenerator::onStatusChanged(uint status, uint reason)
+{
+    Q_UNUSED(reason)
+    m_status = status;
+}
+
+void LoadGenerator::onMessageReceived(const QDBusMessage &message)
+{
+    ++m_messageReceivedSignals;
+    if (!message.arguments().isEmpty()) {
+        // Delivery reports are MessageReceived signals too
+        MessagePartList parts;
+        message.arguments().first().value<QDBusArgument>() >> parts;
+        if (!parts.isEmpty() && (parts.first().value(QStringLiteral("message-type")).toUInt() != c_messageTypeDeliveryReport)) {
+            ++m_receivedMessages;
+            const QString text = parts.value(1).value(QStringLiteral("content")).toString();
+            if (text.startsWith(c_injectedMessagePrefix)) {
+                const int sequence = text.mid(c_injectedMessagePrefix.size()).toInt();
+                if (m_pendingMessages.contains(sequence)) {
+                    m_messageLatencies.append((m_runTimer.nsecsElapsed() - m_pendingMessages.take(sequence)) / 1000000.0);
+                }
+            }
+        }
+    }
+    checkFinished();
+}
+
+void LoadGenerator::onContactsChanged(const QDBusMessage &message)
+{
+    Q_UNUSED(message)
+    ++m_contactsChangedSignals;
+    if (!m_pendingRosterChanges.isEmpty()) {
+        m_rosterLatencies.append((m_runTimer.nsecsElapsed() - m_pendingRosterChanges.dequeue()) / 1000000.0);
+    }
+    checkFinished();
+}
+
+void LoadGenerator::onChatStateChanged(uint contact, uint state)
+{
+    Q_UNUSED(contact)
+    if ((state != c_chatStateComposing) && (state != c_chatStateActive)) {
+        return;
+    }
+    if (!m_pendingTypingEvents.isEmpty()) {
+        m_typingLatencies.append((m_runTimer.nsecsElapsed() - m_pendingTypingEvents.dequeue()) / 1000000.0);
+    }
+    checkFinished();
+}
+
+/* Injects the events due by now; the messages, typing events and roster changes are interleaved */
+void LoadGenerator::injectNext()
+{
+    const int totalEvents = m_options.incomingMessages + m_options.incomingTyping + m_options.rosterChanges;
+    const qint64 dueEvents = qMin<qint64>(totalEvents, m_runTimer.nsecsElapsed() * m_options.injectionRate / 1000000000);
+
+    while (m_injectedEvents < dueEvents) {
+        ++m_injectedEvents;
+        // Round robin over the event kinds which are not exhausted yet
+        for (int i = 0; i < 3; ++i) {
+            const int kind = m_nextEventKind;
+            m_nextEventKind = (m_nextEventKind + 1) % 3;
+            if ((kind == 0) && (m_injectedMessages < m_options.incomingMessages)) {
+                const int sequence = m_injectedMessages++;
+                m_pendingMessages.insert(sequence, m_runTimer.nsecsElapsed());
+                inject(QStringLiteral("InjectMessage"), QVariantList()
+                       << static_cast<uint>(sequence % m_options.incomingPeers)
+                       << c_injectedMessagePrefix + QString::number(sequence));
+                break;
+            }
+            if ((kind == 1) && (m_injectedTypingEvents < m_options.incomingTyping)) {
+                // The first contact, its channel is open (see --peer); typing on and off in turn
+                const bool typing = (m_injectedTypingEvents++ % 2) == 0;
+                m_pendingTypingEvents.enqueue(m_runTimer.nsecsElapsed());
+                inject(QStringLiteral("InjectTyping"), QVariantList() << 0u << typing);
+                break;
+            }
+            if ((kind == 2) && (m_injectedRosterChanges < m_options.rosterChanges)) {
+                // The last contacts (away from the message peers) are removed and added back in turn
+                const int contact = m_options.stubContacts - 1 - (m_injectedRosterChanges++ / 2) % m_options.stubContacts;
+                m_pendingRosterChanges.enqueue(m_runTimer.nsecsElapsed());
+                inject(QStringLiteral("InjectRosterChange"), QVariantList() << static_cast<uint>(contact));
+                break;
+            }
+        }
+    }
+    if (m_injectedEvents >= totalEvents) {
+        m_injectionTimer.stop();
+    }
+}
+
+void LoadGenerator::inject(const QString &method, const QVariantList &arguments)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(c_cmService, c_stubPath, c_stubInterface, method);
+    message.setArguments(arguments);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(message, c_callTimeout), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *watcher) {
+        if (watcher->isError()) {
+            ++m_injectionErrors;
+            qWarning() << "Injection failed:" << watcher->error().message();
+        }
+        watcher->deleteLater();
+    });
+}
+
+/* All the events are injected and the matching signals are received */
+bool LoadGenerator::isInjectionFinished() const
+{
+    if (!m_options.stub) {
+        return true;
+    }
+    const int totalEvents = m_options.incomingMessages + m_options.incomingTyping + m_options.rosterChanges;
+    return (m_injectedEvents >= totalEvents) && m_pendingMessages.isEmpty()
+            && m_pendingTypingEvents.isEmpty() && m_pendingRosterChanges.isEmpty();
+}
+
+void LoadGenerator::sendNext()
+{
+    if (m_messagesSent >= m_options.messages) {
+        return;
+    }
+    ++m_messagesSent;
+
+    QVariantMap header;
+    QVariantMap text;
+    text.insert(QStringLiteral("content-type"), QStringLiteral("text/plain"));
+    text.insert(QStringLiteral("content"), QStringLiteral("Load test message %1").arg(m_messagesSent));
+
+    QDBusMessage message = QDBusMessage::createMethodCall(m_connectionService, m_channelPath,
+                                                          c_messagesInterface, QStringLiteral("SendMessage"));
+    message << QVariant::fromValue(MessagePartList() << header << text) << 0u;
+
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(m_bus.asyncCall(message, c_callTimeout), this);
+    m_pendingSends.insert(watcher, m_runTimer.nsecsElapsed());
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, &LoadGenerator::onSendFinished);
+
+    if (m_typingEventsSent < m_options.typingEvents) {
+        // Typing notifications interleaved with the messages, as in a real chat
+        const uint state = (m_typingEventsSent % 2) ? c_chatStateActive : c_chatStateComposing;
+        QDBusMessage typing = QDBusMessage::createMethodCall(m_connectionService, m_channelPath,
+                                                             c_chatStateInterface, QStringLiteral("SetChatState"));
+        typing << state;
+        m_bus.asyncCall(typing, c_callTimeout);
+        ++m_typingEventsSent;
+    }
+}
+
+void LoadGenerator::onSendFinished(QDBusPendingCallWatcher *watcher)
+{
+    const qint64 startTime = m_pendingSends.take(watcher);
+    if (watcher->isError()) {
+        ++m_sendErrors;
+    } else {
+        m_sendLatencies.append((m_runTimer.nsecsElapsed() - startTime) / 1000000.0);
+    }
+    watcher->deleteLater();
+
+    sendNext();
+    checkFinished();
+}
+
+void LoadGenerator::onDurationElapsed()
+{
+    m_durationElapsed = true;
+    if (m_options.stub) {
+        // The rest of the injection plus a grace period for the signals; the events still
+        // without a signal after that are reported as lost
+        const int totalEvents = m_options.incomingMessages + m_options.incomingTyping + m_options.rosterChanges;
+        const qint64 remainingTime = qint64(totalEvents - m_injectedEvents) * 1000 / m_options.injectionRate;
+        QTimer::singleShot(static_cast<int>(remainingTime) + c_callTimeout, this, &LoadGenerator::finish);
+    }
+    checkFinished();
+}
+
+void LoadGenerator::checkFinished()
+{
+    if (m_durationElapsed && m_pendingSends.isEmpty() && isInjectionFinished()) {
+        finish();
+    }
+}
+
+bool LoadGenerator::waitFor(const std::function<bool()> &condition, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!condition()) {
+        if (timer.hasExpired(timeout)) {
+            return false;
+        }
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+    }
+    return true;
+}
+
+QDBusMessage LoadGenerator::call(const QString &service, const QString &path, const QString &interface,
+                                 const QString &method, const QVariantList &arguments, QString *error)
+{
+    QDBusMessage message = QDBusMessage::createMethodCall(service, path, interface, method);
+    message.setArguments(arguments);
+    const QDBusMessage reply = m_bus.call(message, QDBus::BlockWithGui, c_callTimeout);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        *error = method + QStringLiteral(" failed: ") + reply.errorName() + QLatin1Char(' ') + reply.errorMessage();
+    }
+    return reply;
+}
+
+QHash<QString, double> LoadGenerator::getMetrics()
+{
+    QString error;
+    const QDBusMessage reply = call(c_cmService, c_metricsPath, c_metricsInterface, QStringLiteral("GetMetrics"),
+                                    QVariantList(), &error);
+    if (reply.type() != QDBusMessage::ReplyMessage) {
+        qWarning() << "Unable to get the metrics (is the debug interface enabled?)" << error;
+        return QHash<QString, double>();
+    }
+
+    const QString text = reply.arguments().first().toString();
+    if (!m_options.metricsFile.isEmpty()) {
+        QFile file(m_options.metricsFile);
+        if (file.open(QIODevice::WriteOnly)) {
+            file.write(text.toUtf8());
+        }
+    }
+
+    // Prometheus text format: "name value" lines and the comments
+    QHash<QString, double> result;
+    for (const QString &line : text.split(QLatin1Char('\n'), QString::SkipEmptyParts)) {
+        const int separator = line.lastIndexOf(QLatin1Char(' '));
+        if (line.startsWith(QLatin1Char('#')) || (separator < 0)) {
+            continue;
+        }
+        result.insert(line.left(separator), line.mid(separator + 1).toDouble());
+    }
+    return result;
+}
+
+static double percentile(const QVector<double> &sortedValues, double fraction)
+{
+    if (sortedValues.isEmpty()) {
+        return 0;
+    }
+    const int index = qMin(sortedValues.count() - 1, static_cast<int>(sortedValues.count() * fraction));
+    return sortedValues.at(index);
+}
+
+static QVector<double> sorted(QVector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values;
+}
+
+static QJsonObject latencyStats(const QVector<double> &sortedValues)
+{
+    double sum = 0;
+    for (const double value : sortedValues) {
+        sum += value;
+    }
+
+    QJsonObject result;
+    result.insert(QStringLiteral("mean"), sortedValues.isEmpty() ? 0 : sum / sortedValues.count());
+    result.insert(QStringLiteral("p50"), percentile(sortedValues, 0.5));
+    result.insert(QStringLiteral("p95"), percentile(sortedValues, 0.95));
+    result.insert(QStringLiteral("p99"), percentile(sortedValues, 0.99));
+    result.insert(QStringLiteral("max"), sortedValues.isEmpty() ? 0 : sortedValues.last());
+    return result;
+}
+
+void LoadGenerator::finish()
+{
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+    m_injectionTimer.stop();
+
+    const double elapsed = m_runTimer.nsecsElapsed() / 1000000000.0;
+    const QHash<QString, double> metrics = getMetrics();
+
+    const QVector<double> latencies = sorted(m_sendLatencies);
+    const QVector<double> messageLatencies = sorted(m_messageLatencies);
+    const QVector<double> typingLatencies = sorted(m_typingLatencies);
+    const QVector<double> rosterLatencies = sorted(m_rosterLatencies);
+
+    // The changes made during the run
+    QJsonObject metricsDelta;
+    for (QHash<QString, double>::const_iterator it = metrics.constBegin(); it != metrics.constEnd(); ++it) {
+        const double delta = it.value() - m_initialMetrics.value(it.key());
+        if (delta != 0) {
+            metricsDelta.insert(it.key(), delta);
+        }
+    }
+
+    QJsonObject result;
+    result.insert(QStringLiteral("elapsed_seconds"), elapsed);
+    result.insert(QStringLiteral("messages_sent"), m_sendLatencies.count());
+    result.insert(QStringLiteral("send_errors"), m_sendErrors);
+    result.insert(QStringLiteral("send_per_second"), m_sendLatencies.count() / elapsed);
+    result.insert(QStringLiteral("send_latency_ms"), latencyStats(latencies));
+    result.insert(QStringLiteral("typing_events_sent"), m_typingEventsSent);
+    result.insert(QStringLiteral("message_received_signals"), m_messageReceivedSignals);
+    result.insert(QStringLiteral("received_messages"), m_receivedMessages);
+    result.insert(QStringLiteral("message_received_per_second"), m_messageReceivedSignals / elapsed);
+    result.insert(QStringLiteral("contacts_changed_signals"), m_contactsChangedSignals);
+    result.insert(QStringLiteral("contacts_changed_per_second"), m_contactsChangedSignals / elapsed);
+    if (m_options.stub) {
+        // From the injection call to the client signal
+        QJsonObject injected;
+        injected.insert(QStringLiteral("messages"), m_injectedMessages);
+        injected.insert(QStringLiteral("typing_events"), m_injectedTypingEvents);
+        injected.insert(QStringLiteral("roster_changes"), m_injectedRosterChanges);
+        injected.insert(QStringLiteral("errors"), m_injectionErrors);
+        injected.insert(QStringLiteral("per_second"), m_injectedEvents / elapsed);
+        result.insert(QStringLiteral("injected"), injected);
+        result.insert(QStringLiteral("message_received_latency_ms"), latencyStats(messageLatencies));
+        result.insert(QStringLiteral("chat_state_changed_latency_ms"), latencyStats(typingLatencies));
+        result.insert(QStringLiteral("contacts_changed_latency_ms"), latencyStats(rosterLatencies));
+        QJsonObject lost;
+        lost.insert(QStringLiteral("messages"), m_pendingMessages.count());
+        lost.insert(QStringLiteral("typing_events"), m_pendingTypingEvents.count());
+        lost.insert(QStringLiteral("roster_changes"), m_pendingRosterChanges.count());
+        result.insert(QStringLiteral("lost"), lost);
+    }
+    result.insert(QStringLiteral("metrics_delta"), metricsDelta);
+
+    QTextStream(stdout) << QJsonDocument(result).toJson();
+
+    int exitCode = 0;
+    if ((m_options.maxSendLatency > 0) && (percentile(latencies, 0.95) > m_options.maxSendLatency)) {
+        qWarning() << "The send latency p95 is over the limit:" << percentile(latencies, 0.95) << "ms";
+        exitCode = 1;
+    }
+    if (m_receivedMessages < m_options.minReceived) {
+        qWarning() << "Received" << m_receivedMessages << "messages, expected at least" << m_options.minReceived;
+        exitCode = 1;
+    }
+    if (m_options.maxReceiveLatency > 0) {
+        const double messageLatency = percentile(messageLatencies, 0.95);
+        const double rosterLatency = percentile(rosterLatencies, 0.95);
+        if (messageLatency > m_options.maxReceiveLatency) {
+            qWarning() << "The MessageReceived latency p95 is over the limit:" << messageLatency << "ms";
+            exitCode = 1;
+        }
+        if (rosterLatency > m_options.maxReceiveLatency) {
+            qWarning() << "The ContactsChanged latency p95 is over the limit:" << rosterLatency << "ms";
+            exitCode = 1;
+        }
+    }
+    if (m_options.stub && !isInjectionFinished()) {
+        qWarning() << "Not all the injected events have reached the client";
+        exitCode = 1;
+    }
+
+    stop();
+    emit finished(exitCode);
+}
+
+void LoadGenerator::stop()
+{
+    if (m_status != c_statusDisconnected) {
+        QString error;
+        call(m_connectionService, m_connectionPath, c_connectionInterface, QStringLiteral("Disconnect"), QVariantList(), &error);
+        m_status = c_statusDisconnected;
+    }
+    // SIGTERM, so the trace file is written if MORSE_TRACE_FILE is set
+    if (m_cmProcess.state() != QProcess::NotRunning) {
+        m_cmProcess.terminate();
+        if (!m_cmProcess.waitForFinished(c_startTimeout)) {
+            m_cmProcess.kill();
+            m_cmProcess.waitForFinished();
+        }
+    }
+    if (m_busProcess.state() != QProcess::NotRunning) {
+        m_busProcess.terminate();
+        m_busProcess.waitForFinished();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(QStringLiteral("morse-load"));
+    qDBusRegisterMetaType<MessagePartList>();
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("End-to-end D-Bus load generator for telepathy-morse"));
+    parser.addHelpOption();
+    const QCommandLineOption cmOption(QStringLiteral("cm"), QStringLiteral("The connection manager binary."),
+                                      QStringLiteral("path"), QLatin1String(MORSE_BINARY));
+    const QCommandLineOption cmLogOption(QStringLiteral("cm-log"), QStringLiteral("Write the connection manager output to the file."),
+                                         QStringLiteral("file"));
+    const QCommandLineOption accountOption(QStringLiteral("account"), QStringLiteral("The account phone number (required)."),
+                                           QStringLiteral("phone"));
+    const QCommandLineOption serverAddressOption(QStringLiteral("server-address"), QStringLiteral("The Telegram server address."),
+                                                 QStringLiteral("address"));
+    const QCommandLineOption serverPortOption(QStringLiteral("server-port"), QStringLiteral("The Telegram server port."),
+                                              QStringLiteral("port"));
+    const QCommandLineOption serverKeyOption(QStringLiteral("server-key"), QStringLiteral("The Telegram server public key file."),
+                                             QStringLiteral("file"));
+    const QCommandLineOption peerOption(QStringLiteral("peer"), QStringLiteral("The peer to send messages to (e.g. user123)."),
+                                        QStringLiteral("identifier"));
+    const QCommandLineOption messagesOption(QStringLiteral("messages"), QStringLiteral("The number of messages to send."),
+                                            QStringLiteral("count"), QStringLiteral("1000"));
+    const QCommandLineOption typingOption(QStringLiteral("typing"), QStringLiteral("The number of typing events to send."),
+                                          QStringLiteral("count"), QStringLiteral("1000"));
+    const QCommandLineOption concurrencyOption(QStringLiteral("concurrency"), QStringLiteral("The number of messages in flight."),
+                                               QStringLiteral("count"), QStringLiteral("16"));
+    const QCommandLineOption durationOption(QStringLiteral("duration"), QStringLiteral("The minimum run time for the incoming signals."),
+                                            QStringLiteral("seconds"), QStringLiteral("30"));
+    const QCommandLineOption metricsOption(QStringLiteral("metrics-output"), QStringLiteral("Write the final metrics to the file."),
+                                           QStringLiteral("file"));
+    const QCommandLineOption maxLatencyOption(QStringLiteral("max-send-latency"), QStringLiteral("Fail if the send latency p95 is higher."),
+                                              QStringLiteral("ms"));
+    const QCommandLineOption minReceivedOption(QStringLiteral("min-received"), QStringLiteral("Fail if fewer messages are received."),
+                                               QStringLiteral("count"));
+    const QCommandLineOption stubOption(QStringLiteral("stub"), QStringLiteral("Use the stub connection manager (no server and account needed)."));
+    const QCommandLineOption stubContactsOption(QStringLiteral("contacts"), QStringLiteral("The number of the stub contacts."),
+                                                QStringLiteral("count"), QStringLiteral("100"));
+    const QCommandLineOption incomingOption(QStringLiteral("incoming"), QStringLiteral("The number of messages to inject (stub)."),
+                                            QStringLiteral("count"), QStringLiteral("1000"));
+    const QCommandLineOption incomingPeersOption(QStringLiteral("incoming-peers"), QStringLiteral("The number of contacts the injected messages come from (stub)."),
+                                                 QStringLiteral("count"), QStringLiteral("1"));
+    const QCommandLineOption incomingTypingOption(QStringLiteral("incoming-typing"), QStringLiteral("The number of typing events to inject (stub)."),
+                                                  QStringLiteral("count"), QStringLiteral("1000"));
+    const QCommandLineOption rosterChangesOption(QStringLiteral("roster-changes"), QStringLiteral("The number of roster changes to inject (stub)."),
+                                                 QStringLiteral("count"), QStringLiteral("100"));
+    const QCommandLineOption rateOption(QStringLiteral("rate"), QStringLiteral("The injection rate (stub)."),
+                                        QStringLiteral("events per second"), QStringLiteral("200"));
+    const QCommandLineOption maxReceiveLatencyOption(QStringLiteral("max-receive-latency"),
+                                                     QStringLiteral("Fail if the MessageReceived or ContactsChanged latency p95 is higher (stub)."),
+                                                     QStringLiteral("ms"));
+    parser.addOptions({ cmOption, cmLogOption, accountOption, serverAddressOption, serverPortOption, serverKeyOption,
+                        peerOption, messagesOption, typingOption, concurrencyOption, durationOption,
+                        metricsOption, maxLatencyOption, minReceivedOption,
+                        stubOption, stubContactsOption, incomingOption, incomingPeersOption, incomingTypingOption,
+                        rosterChangesOption, rateOption, maxReceiveLatencyOption });
+    parser.process(app);
+
+    LoadOptions options;
+    options.stub = parser.isSet(stubOption);
+    if (!options.stub && !parser.isSet(accountOption)) {
+        qCritical() << "The account is required";
+        return 2;
+    }
+
+    options.cmBinary = parser.value(cmOption);
+    if (options.stub && !parser.isSet(cmOption)) {
+#ifdef MORSE_STUB_BINARY
+        options.cmBinary = QLatin1String(MORSE_STUB_BINARY);
+#else
+        qCritical() << "The stub connection manager is not built (see TELEGRAM_QT5_PRIVATE_INCLUDE_DIR), pass it via --cm";
+        return 2;
+#endif
+    }
+    options.cmLogFile = parser.value(cmLogOption);
+    options.parameters.insert(QStringLiteral("account"), parser.isSet(accountOption) ? parser.value(accountOption)
+                                                                                     : QStringLiteral("+9997000000"));
+    if (parser.isSet(serverAddressOption)) {
+        options.parameters.insert(QStringLiteral("server-address"), parser.value(serverAddressOption));
+    }
+    if (parser.isSet(serverPortOption)) {
+        options.parameters.insert(QStringLiteral("server-port"), parser.value(serverPortOption).toUInt());
+    }
+    if (parser.isSet(serverKeyOption)) {
+        options.parameters.insert(QStringLiteral("server-key"), parser.value(serverKeyOption));
+    }
+    options.peer = parser.value(peerOption);
+    options.messages = parser.value(messagesOption).toInt();
+    options.typingEvents = parser.value(typingOption).toInt();
+    options.concurrency = qMax(1, parser.value(concurrencyOption).toInt());
+    options.duration = parser.value(durationOption).toInt();
+    options.metricsFile = parser.value(metricsOption);
+    options.maxSendLatency = parser.value(maxLatencyOption).toDouble();
+    options.minReceived = parser.value(minReceivedOption).toInt();
+
+    if (options.stub) {
+        // The stub has no server to send the messages to, so nothing is sent unless asked
+        if (!parser.isSet(messagesOption)) {
+            options.messages = 0;
+        }
+        if (!parser.isSet(typingOption)) {
+            options.typingEvents = 0;
+        }
+        if (options.peer.isEmpty()) {
+            // The channel of the injected typing events
+            options.peer = QStringLiteral("user1");
+        }
+        options.stubContacts = qMax(1, parser.value(stubContactsOption).toInt());
+        options.incomingMessages = qMax(0, parser.value(incomingOption).toInt());
+        options.incomingPeers = qBound(1, parser.value(incomingPeersOption).toInt(), options.stubContacts);
+        options.incomingTyping = qMax(0, parser.value(incomingTypingOption).toInt());
+        options.rosterChanges = qMax(0, parser.value(rosterChangesOption).toInt());
+        options.injectionRate = qMax(1, parser.value(rateOption).toInt());
+        options.maxReceiveLatency = parser.value(maxReceiveLatencyOption).toDouble();
+    }
+
+    LoadGenerator generator(options);
+    QString error;
+    if (!generator.start(&error)) {
+        qCritical() << error;
+        return 2;
+    }
+    QObject::connect(&generator, &LoadGenerator::finished, &app, &QCoreApplication::exit);
+    generator.run();
+    return app.exec();
+}
+
+#include "morse-load.moc"
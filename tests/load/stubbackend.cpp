@@ -0,0 +1,109 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "stubbackend.hpp"
+#include "connection.hpp"
+#include "fakeclient/fakeclient.hpp"
+
+#include <TelepathyQt/Constants>
+
+#include <QDBusConnection>
+#include <QDebug>
+
+static const QString c_stubObjectPath = QString(TP_QT_DEBUG_OBJECT_PATH) + QLatin1String("/stub");
+static const int c_defaultContactsCount = 100;
+
+MorseStubBackend::MorseStubBackend(QObject *parent) :
+    QObject(parent)
+{
+}
+
+MorseStubBackend::~MorseStubBackend()
+{
+}
+
+bool MorseStubBackend::registerObject()
+{
+    return QDBusConnection::sessionBus().registerObject(c_stubObjectPath, this, QDBusConnection::ExportScriptableSlots);
+}
+
+Tp::BaseConnectionPtr MorseStubBackend::createConnection(const QVariantMap &parameters, Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+
+    // One connection at a time, the load generator uses a single account
+    m_client.reset();
+    m_connection = Tp::BaseConnection::create<MorseConnection>(QLatin1String("morse"), QLatin1String("telegram"), parameters);
+    m_connection->setConnectCallback(Tp::memFun(this, &MorseStubBackend::connectToStub));
+    return m_connection;
+}
+
+void MorseStubBackend::connectToStub(Tp::DBusError *error)
+{
+    Q_UNUSED(error)
+
+    int contactsCount = qgetenv("MORSE_STUB_CONTACTS").toInt();
+    if (contactsCount <= 0) {
+        contactsCount = c_defaultContactsCount;
+    }
+
+    m_connection->setStatus(Tp::ConnectionStatusConnecting, Tp::ConnectionStatusReasonRequested);
+    m_client.reset(new MorseFakeClient(m_connection.data()));
+    m_client->populate(contactsCount, /* messagesPerContact */ 0);
+    // The initial roster goes before the status change, so it is not a part of the measurement
+    m_client->loadContactList();
+    m_client->setConnected();
+}
+
+bool MorseStubBackend::isConnected() const
+{
+    if (m_client) {
+        return true;
+    }
+    qWarning() << "Stub: the injection is ignored, the connection is not connected";
+    return false;
+}
+
+void MorseStubBackend::InjectMessage(uint contact, const QString &text)
+{
+    if (!isConnected()) {
+        return;
+    }
+    const QVector<Telegram::Peer> contacts = m_client->contacts();
+    // The live update path: batched by the connection and delivered to the (new or open) channel
+    m_client->receiveMessage(contacts.at(contact % contacts.count()), text);
+}
+
+void MorseStubBackend::InjectTyping(uint contact, bool typing)
+{
+    if (!isConnected()) {
+        return;
+    }
+    const QVector<Telegram::Peer> contacts = m_client->contacts();
+    m_client->setTyping(contacts.at(contact % contacts.count()), typing);
+}
+
+void MorseStubBackend::InjectRosterChange(uint contact)
+{
+    if (!isConnected()) {
+        return;
+    }
+    const QVector<Telegram::Peer> contacts = m_client->contacts();
+    m_client->toggleContact(contacts.at(contact % contacts.count()));
+}
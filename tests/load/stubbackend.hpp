@@ -0,0 +1,65 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_STUBBACKEND_HPP
+#define MORSE_STUBBACKEND_HPP
+
+#include <QObject>
+#include <QScopedPointer>
+
+#include <TelepathyQt/BaseConnection>
+
+class MorseConnection;
+class MorseFakeClient;
+
+/**
+ * Stub Telegram backend of telepathy-morse-stub.
+ *
+ * The connections are created as usual, but connect to a MorseFakeClient
+ * with MORSE_STUB_CONTACTS synthetic contacts (100 by default) instead of
+ * the server. The load generator injects the incoming messages, typing
+ * events and roster changes via this object on D-Bus; they take the same
+ * path through the connection as the server updates.
+ */
+class MorseStubBackend : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.Telepathy.ConnectionManager.morse.Stub")
+public:
+    explicit MorseStubBackend(QObject *parent = nullptr);
+    ~MorseStubBackend();
+
+    bool registerObject();
+    Tp::BaseConnectionPtr createConnection(const QVariantMap &parameters, Tp::DBusError *error);
+
+public slots:
+    /* The contact index wraps around the synthetic contacts */
+    Q_SCRIPTABLE void InjectMessage(uint contact, const QString &text);
+    Q_SCRIPTABLE void InjectTyping(uint contact, bool typing);
+    Q_SCRIPTABLE void InjectRosterChange(uint contact);
+
+private:
+    void connectToStub(Tp::DBusError *error);
+    bool isConnected() const;
+
+    Tp::SharedPtr<MorseConnection> m_connection;
+    QScopedPointer<MorseFakeClient> m_client;
+};
+
+#endif // MORSE_STUBBACKEND_HPP
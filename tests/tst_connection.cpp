@@ -0,0 +1,328 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "connection.hpp"
+#include "textchannel.hpp"
+#include "fakeclient/fakeclient.hpp"
+
+#include <TelepathyQt/Constants>
+#include <TelepathyQt/Types>
+
+#include <TelegramQt/Client>
+#include <TelegramQt/DataStorage>
+
+#include <QDBusConnection>
+#include <QDebug>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+
+/**
+ * MorseConnection benchmarks over synthetic data, see MorseFakeClient.
+ *
+ * The scale rows are taken from MORSE_BENCHMARK_SCALES (comma separated counts,
+ * 1000 and 10000 by default). Use e.g. "-o results.csv,csv" for the machine readable output.
+ * The channels are registered on the session bus (run via dbus-run-session).
+ */
+class tst_Connection : public QObject
+{
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void cleanup();
+    void benchmarkLoadContactList_data();
+    void benchmarkLoadContactList();
+    void benchmarkUpdateContactList_data();
+    void benchmarkUpdateContactList();
+    void benchmarkAddMessages_data();
+    void benchmarkAddMessages();
+    void benchmarkGetContactAttributes_data();
+    void benchmarkGetContactAttributes();
+    void benchmarkInspectHandles_data();
+    void benchmarkInspectHandles();
+    void benchmarkMessageActionDispatch_data();
+    void benchmarkMessageActionDispatch();
+    void benchmarkMessageConversion_data();
+    void benchmarkMessageConversion();
+    void benchmarkGetContactListAttributes_data();
+    void benchmarkGetContactListAttributes();
+
+private:
+    static void addScaleRows();
+    bool createConnection(int contactsCount, int messagesPerContact = 0);
+    Tp::UIntList contactHandles() const;
+
+    QScopedPointer<QTemporaryDir> m_dataDir;
+    Tp::SharedPtr<MorseConnection> m_connection;
+    QScopedPointer<MorseFakeClient> m_client;
+    int m_connectionsCount = 0;
+};
+
+void tst_Connection::addScaleRows()
+{
+    QTest::addColumn<int>("count");
+    QString scales = QString::fromLocal8Bit(qgetenv("MORSE_BENCHMARK_SCALES"));
+    if (scales.isEmpty()) {
+        scales = QStringLiteral("1000,10000");
+    }
+    for (const QString &scale : scales.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        const int count = scale.trimmed().toInt();
+        if (count > 0) {
+            QTest::newRow(qPrintable(QString::number(count))) << count;
+        }
+    }
+}
+
+bool tst_Connection::createConnection(int contactsCount, int messagesPerContact)
+{
+    // A new account per connection, so the bus names and the data directories never clash
+    QVariantMap parameters;
+    parameters.insert(QStringLiteral("account"), QStringLiteral("+9997%1").arg(++m_connectionsCount, 6, 10, QLatin1Char('0')));
+
+    m_connection = Tp::BaseConnection::create<MorseConnection>(QLatin1String("morse"), QLatin1String("telegram"), parameters);
+    Tp::DBusError error;
+    if (!m_connection->registerObject(&error)) {
+        qWarning() << "Unable to register the connection:" << error.name() << error.message();
+        return false;
+    }
+
+    m_client.reset(new MorseFakeClient(m_connection.data()));
+    m_client->populate(contactsCount, messagesPerContact);
+    return true;
+}
+
+Tp::UIntList tst_Connection::contactHandles() const
+{
+    Tp::UIntList handles;
+    handles.reserve(m_client->contacts().count());
+    for (const Telegram::Peer &peer : m_client->contacts()) {
+        handles.append(m_connection->ensureContact(peer));
+    }
+    return handles;
+}
+
+void tst_Connection::initTestCase()
+{
+    if (!QDBusConnection::sessionBus().isConnected()) {
+        QSKIP("No session bus");
+    }
+    Telegram::initialize();
+    Tp::registerTypes();
+
+    // The account data (state storage, caches) goes to a temporary directory
+    m_dataDir.reset(new QTemporaryDir());
+    QVERIFY(m_dataDir->isValid());
+    qputenv("XDG_DATA_HOME", QFile::encodeName(m_dataDir->path()));
+}
+
+void tst_Connection::cleanup()
+{
+    m_client.reset();
+    m_connection.reset();
+}
+
+void tst_Connection::benchmarkLoadContactList_data()
+{
+    addScaleRows();
+}
+
+void tst_Connection::benchmarkLoadContactList()
+{
+    QFETCH(int, count);
+    QVERIFY(createConnection(count));
+
+    // The first load after the connection, each contact is new
+    QBENCHMARK_ONCE {
+        m_client->loadContactList();
+    }
+}
+
+void tst_Connection::benchmarkUpdateContactList_data()
+{
+    addScaleRows();
+}
+
+void tst_Connection::benchmarkUpdateContactList()
+{
+    QFETCH(int, count);
+    QVERIFY(createConnection(count));
+    m_client->loadContactList();
+
+    // A roster update with a single change (one contact removed or added back)
+    const Telegram::Peer churnPeer = m_client->contacts().last();
+    QBENCHMARK {
+        m_client->toggleContact(churnPeer);
+    }
+}
+
+void tst_Connection::benchmarkAddMessages_data()
+{
+    addScaleRows();
+}
+
+void tst_Connection::benchmarkAddMessages()
+{
+    QFETCH(int, count);
+    QVERIFY(createConnection(1));
+    const Telegram::Peer peer = m_client->contacts().first();
+    // Open the channel beforehand
+    m_connection->addMessages(peer, m_client->addIncomingMessages(peer, 1));
+
+    // A batch of new messages in an open channel (the storage insert is included,
+    // it is small compared to the conversion and the D-Bus signals)
+    QBENCHMARK {
+        m_connection->addMessages(peer, m_client->addIncomingMessages(peer, count));
+    }
+}
+
+void tst_Connection::benchmarkGetContactAttributes_data()
+{
+    addScaleRows();
+}
+
+void tst_Connection::benchmarkGetContactAttributes()
+{
+    QFETCH(int, count);
+    QVERIFY(createConnection(count));
+    m_client->loadContactList();
+
+    const Tp::UIntList handles = contactHandles();
+    const QStringList interfaces = QStringList()
+            << TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST
+            << TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE
+            << TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING
+            << TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS;
+    Tp::DBusError error;
+    QBENCHMARK {
+        const Tp::ContactAttributesMap attributes = m_connection->getContactAttributes(handles, interfaces, &error);
+        QCOMPARE(attributes.count(), count);
+    }
+}
+
+void tst_Connection::benchmarkInspectHandles_data()
+{
+    addScaleRows();
+}
+
+void tst_Connection::benchmarkInspectHandles()
+{
+    QFETCH(int, count);
+    QVERIFY(createConnection(count));
+
+    const Tp::UIntList handles = contactHandles();
+    Tp::DBusError error;
+    QBENCHMARK {
+        const QStringList identifiers = m_connection->inspectHandles(Tp::HandleTypeContact, handles, &error);
+        QCOMPARE(identifiers.count(), count);
+    }
+}
+
+void tst_Connection::benchmarkMessageActionDispatch_data()
+{
+    QTest::addColumn<int>("channelsCount");
+    QTest::newRow("10 channels") << 10;
+    QTest::newRow("100 channels") << 100;
+    QTest::newRow("500 channels") << 500;
+}
+
+void tst_Connection::benchmarkMessageActionDispatch()
+{
+    QFETCH(int, channelsCount);
+    QVERIFY(createConnection(channelsCount));
+    for (const Telegram::Peer &peer : m_client->contacts()) {
+        m_connection->addMessages(peer, m_client->addIncomingMessages(peer, 1));
+    }
+
+    // A typing event is routed to its channel only, so the cost must not grow with the open channels
+    const Telegram::Peer peer = m_client->contacts().first();
+    bool typing = false;
+    QBENCHMARK {
+        typing = !typing;
+        m_client->setTyping(peer, typing);
+    }
+}
+
+void tst_Connection::benchmarkMessageConversion_data()
+{
+    QTest::addColumn<int>("messagesCount");
+    QTest::newRow("100 messages") << 100;
+    QTest::newRow("1000 messages") << 1000;
+}
+
+void tst_Connection::benchmarkMessageConversion()
+{
+    QFETCH(int, messagesCount);
+    QVERIFY(createConnection(1));
+    const Telegram::Peer peer = m_client->contacts().first();
+    const QVector<quint32> messageIds = m_client->addIncomingMessages(peer, messagesCount);
+    m_connection->addMessages(peer, messageIds.mid(0, 1));
+    MorseTextChannel *channel = m_client->textChannel(peer);
+    QVERIFY(channel);
+
+    QVector<Telegram::Message> messages;
+    for (const quint32 messageId : messageIds) {
+        Telegram::Message message;
+        QVERIFY(m_connection->core()->dataStorage()->getMessage(&message, peer, messageId));
+        messages.append(message);
+    }
+
+    // The Telegram message to Telepathy message part conversion and the MessageReceived signal;
+    // the messages per second are messagesCount divided by the reported time
+    QBENCHMARK {
+        for (const Telegram::Message &message : messages) {
+            channel->onMessageReceived(message);
+        }
+    }
+}
+
+void tst_Connection::benchmarkGetContactListAttributes_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("cached");
+    QTest::newRow("10k contacts, cold cache") << 10000 << false;
+    QTest::newRow("10k contacts, warm cache") << 10000 << true;
+}
+
+void tst_Connection::benchmarkGetContactListAttributes()
+{
+    QFETCH(int, count);
+    QFETCH(bool, cached);
+    QVERIFY(createConnection(count));
+    m_client->loadContactList();
+
+    // The whole roster query of a client on the connection start
+    const QStringList interfaces = QStringList()
+            << TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_LIST
+            << TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE
+            << TP_QT_IFACE_CONNECTION_INTERFACE_ALIASING
+            << TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS
+            << TP_QT_IFACE_CONNECTION_INTERFACE_CONTACT_INFO;
+    Tp::DBusError error;
+    QBENCHMARK {
+        if (!cached) {
+            m_client->clearContactAttributesCache();
+        }
+        const Tp::ContactAttributesMap attributes = m_connection->getContactListAttributes(interfaces, false, &error);
+        QCOMPARE(attributes.count(), count);
+    }
+}
+
+QTEST_GUILESS_MAIN(tst_Connection)
+
+#include "tst_connection.moc"
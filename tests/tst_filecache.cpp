@@ -0,0 +1,231 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "filecache.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+
+class tst_FileCache : public QObject
+{
+    Q_OBJECT
+private slots:
+    void init();
+    void insert();
+    void evictLeastRecentlyUsed();
+    void tooLarge();
+    void load();
+    void loadSkipsPartialFiles();
+    void addFile();
+    void benchmarkInsert();
+    void benchmarkData();
+
+private:
+    QString filePath(const QString &token) const;
+    void writeFile(const QString &token, const QByteArray &data);
+
+    QScopedPointer<QTemporaryDir> m_dir;
+};
+
+static const int c_benchmarkFilesCount = 1000;
+
+QString tst_FileCache::filePath(const QString &token) const
+{
+    return m_dir->path() + QLatin1Char('/') + MorseFileCache::fileName(token);
+}
+
+void tst_FileCache::writeFile(const QString &token, const QByteArray &data)
+{
+    QFile file(filePath(token));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(data), static_cast<qint64>(data.size()));
+}
+
+void tst_FileCache::init()
+{
+    m_dir.reset(new QTemporaryDir());
+    QVERIFY(m_dir->isValid());
+}
+
+void tst_FileCache::insert()
+{
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(1024);
+
+    const QByteArray data("avatar");
+    QVERIFY(!cache.contains(QLatin1String("token")));
+    QVERIFY(cache.insert(QLatin1String("token"), data));
+    QVERIFY(cache.contains(QLatin1String("token")));
+    QCOMPARE(cache.data(QLatin1String("token")), data);
+    QCOMPARE(cache.size(), static_cast<qint64>(data.size()));
+    QVERIFY(QFile::exists(filePath(QLatin1String("token"))));
+
+    QVERIFY(!cache.insert(QString(), data));
+    QVERIFY(!cache.insert(QLatin1String("empty"), QByteArray()));
+    QCOMPARE(cache.data(QLatin1String("unknown")), QByteArray());
+}
+
+void tst_FileCache::evictLeastRecentlyUsed()
+{
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(30);
+
+    const QByteArray data(10, 'x');
+    QVERIFY(cache.insert(QLatin1String("a"), data));
+    QVERIFY(cache.insert(QLatin1String("b"), data));
+    QVERIFY(cache.insert(QLatin1String("c"), data));
+
+    // "b" is the least recently used now
+    QCOMPARE(cache.data(QLatin1String("a")), data);
+    cache.markUsed(QLatin1String("c"));
+
+    QVERIFY(cache.insert(QLatin1String("d"), data));
+    QVERIFY(cache.contains(QLatin1String("a")));
+    QVERIFY(!cache.contains(QLatin1String("b")));
+    QVERIFY(cache.contains(QLatin1String("c")));
+    QVERIFY(cache.contains(QLatin1String("d")));
+    QVERIFY(!QFile::exists(filePath(QLatin1String("b"))));
+    QCOMPARE(cache.size(), 30ll);
+
+    // Shrinking evicts the oldest entries
+    cache.setMaximumSize(10);
+    QCOMPARE(cache.size(), 10ll);
+    QVERIFY(cache.contains(QLatin1String("d")));
+}
+
+void tst_FileCache::tooLarge()
+{
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(10);
+
+    QVERIFY(cache.insert(QLatin1String("a"), QByteArray(10, 'x')));
+    QVERIFY(!cache.insert(QLatin1String("b"), QByteArray(11, 'x')));
+    // Nothing is evicted for a rejected entry
+    QVERIFY(cache.contains(QLatin1String("a")));
+}
+
+void tst_FileCache::load()
+{
+    {
+        MorseFileCache cache;
+        cache.setDirectory(m_dir->path());
+        cache.setMaximumSize(1024);
+        QVERIFY(cache.insert(QLatin1String("a"), QByteArray(10, 'a')));
+        QVERIFY(cache.insert(QLatin1String("b"), QByteArray(20, 'b')));
+    }
+
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(1024);
+    cache.load();
+    QCOMPARE(cache.size(), 30ll);
+    QCOMPARE(cache.data(QLatin1String("b")), QByteArray(20, 'b'));
+
+    // The budget is applied on load too
+    MorseFileCache smallCache;
+    smallCache.setDirectory(m_dir->path());
+    smallCache.setMaximumSize(20);
+    smallCache.load();
+    QVERIFY(smallCache.size() <= 20);
+}
+
+void tst_FileCache::loadSkipsPartialFiles()
+{
+    writeFile(QLatin1String("a"), QByteArray(10, 'a'));
+    QFile partialFile(filePath(QLatin1String("b")) + MorseFileCache::partialFileSuffix());
+    QVERIFY(partialFile.open(QIODevice::WriteOnly));
+    partialFile.write(QByteArray(40, 'b'));
+    partialFile.close();
+
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(30);
+    cache.load();
+    QCOMPARE(cache.size(), 10ll);
+    QVERIFY(cache.contains(QLatin1String("a")));
+    // Neither accounted nor evicted
+    QVERIFY(partialFile.exists());
+}
+
+void tst_FileCache::addFile()
+{
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(30);
+
+    QVERIFY(!cache.addFile(QLatin1String("missing")));
+
+    // Written by the file manager
+    writeFile(QLatin1String("a"), QByteArray(20, 'a'));
+    QVERIFY(cache.addFile(QLatin1String("a")));
+    QVERIFY(cache.contains(QLatin1String("a")));
+    QCOMPARE(cache.size(), 20ll);
+
+    writeFile(QLatin1String("b"), QByteArray(20, 'b'));
+    QVERIFY(cache.addFile(QLatin1String("b")));
+    QVERIFY(!cache.contains(QLatin1String("a")));
+    QVERIFY(!QFile::exists(filePath(QLatin1String("a"))));
+    QCOMPARE(cache.size(), 20ll);
+
+    // The file can never fit, so it is removed right away
+    writeFile(QLatin1String("c"), QByteArray(40, 'c'));
+    QVERIFY(!cache.addFile(QLatin1String("c")));
+    QVERIFY(!QFile::exists(filePath(QLatin1String("c"))));
+    QVERIFY(cache.contains(QLatin1String("b")));
+}
+
+void tst_FileCache::benchmarkInsert()
+{
+    const QByteArray data(4096, 'x');
+    int round = 0;
+    QBENCHMARK {
+        MorseFileCache cache;
+        cache.setDirectory(m_dir->path() + QLatin1Char('/') + QString::number(++round));
+        // Half of the avatars fit, so the second half evicts the first one
+        cache.setMaximumSize(data.size() * c_benchmarkFilesCount / 2);
+        for (int i = 0; i < c_benchmarkFilesCount; ++i) {
+            cache.insert(QString::number(i), data);
+        }
+    }
+}
+
+void tst_FileCache::benchmarkData()
+{
+    MorseFileCache cache;
+    cache.setDirectory(m_dir->path());
+    cache.setMaximumSize(4096 * c_benchmarkFilesCount);
+    for (int i = 0; i < c_benchmarkFilesCount; ++i) {
+        cache.insert(QString::number(i), QByteArray(4096, 'x'));
+    }
+
+    QBENCHMARK {
+        for (int i = 0; i < c_benchmarkFilesCount; ++i) {
+            cache.data(QString::number(i));
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_FileCache)
+
+#include "tst_filecache.moc"
@@ -0,0 +1,132 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "extras/CFileManager.hpp"
+
+#include <QTest>
+
+class tst_FileInfo : public QObject
+{
+    Q_OBJECT
+private slots:
+    void addRange_data();
+    void addRange();
+    void assembleData();
+    void benchmarkAddRange_data();
+    void benchmarkAddRange();
+};
+
+typedef QVector<QPair<quint32, quint32>> ChunkList; // Offset and size
+
+Q_DECLARE_METATYPE(ChunkList)
+
+static FileInfo createStreamedInfo(quint32 totalSize)
+{
+    // Streamed, so only the ranges are tracked
+    FileInfo info;
+    info.setFileName(QLatin1String("unused"));
+    info.setTotalSize(totalSize);
+    return info;
+}
+
+void tst_FileInfo::addRange_data()
+{
+    QTest::addColumn<ChunkList>("chunks");
+    QTest::addColumn<quint32>("receivedSize");
+    QTest::addColumn<bool>("covered");
+
+    const quint32 chunk = 10;
+    QTest::newRow("sequential") << (ChunkList() << qMakePair(0u, chunk) << qMakePair(10u, chunk) << qMakePair(20u, chunk))
+                                << 30u << true;
+    QTest::newRow("reversed") << (ChunkList() << qMakePair(20u, chunk) << qMakePair(10u, chunk) << qMakePair(0u, chunk))
+                              << 30u << true;
+    QTest::newRow("gap") << (ChunkList() << qMakePair(0u, chunk) << qMakePair(20u, chunk))
+                         << 20u << false;
+    QTest::newRow("gap filled") << (ChunkList() << qMakePair(0u, chunk) << qMakePair(20u, chunk) << qMakePair(10u, chunk))
+                                << 30u << true;
+    QTest::newRow("duplicate") << (ChunkList() << qMakePair(0u, chunk) << qMakePair(0u, chunk) << qMakePair(10u, 20u))
+                               << 30u << true;
+    QTest::newRow("overlap") << (ChunkList() << qMakePair(0u, 15u) << qMakePair(10u, 15u) << qMakePair(5u, 25u))
+                             << 30u << true;
+    QTest::newRow("contained") << (ChunkList() << qMakePair(0u, 30u) << qMakePair(5u, 5u))
+                               << 30u << true;
+    QTest::newRow("spanning") << (ChunkList() << qMakePair(5u, 5u) << qMakePair(15u, 5u) << qMakePair(25u, 5u) << qMakePair(0u, 30u))
+                              << 30u << true;
+    QTest::newRow("empty chunk") << (ChunkList() << qMakePair(0u, 0u))
+                                 << 0u << false;
+    QTest::newRow("missing head") << (ChunkList() << qMakePair(10u, 20u))
+                                  << 20u << false;
+}
+
+void tst_FileInfo::addRange()
+{
+    QFETCH(ChunkList, chunks);
+    QFETCH(quint32, receivedSize);
+    QFETCH(bool, covered);
+
+    FileInfo info = createStreamedInfo(30);
+    for (const QPair<quint32, quint32> &c : chunks) {
+        info.addData(c.first, QByteArray(static_cast<int>(c.second), 'x'));
+    }
+    QCOMPARE(info.receivedSize(), receivedSize);
+    QCOMPARE(info.isCovered(), covered);
+}
+
+void tst_FileInfo::assembleData()
+{
+    FileInfo info;
+    info.setTotalSize(9);
+    info.addData(6, QByteArrayLiteral("ghi"));
+    info.addData(0, QByteArrayLiteral("abc"));
+    info.addData(3, QByteArrayLiteral("def"));
+    QVERIFY(info.isCovered());
+    info.setMimeType(QLatin1String("text/plain"));
+    info.completeDownload();
+    QVERIFY(info.isComplete());
+    QCOMPARE(info.data(), QByteArrayLiteral("abcdefghi"));
+}
+
+void tst_FileInfo::benchmarkAddRange_data()
+{
+    QTest::addColumn<bool>("reversed");
+    QTest::newRow("in order") << false;
+    QTest::newRow("reversed") << true;
+}
+
+void tst_FileInfo::benchmarkAddRange()
+{
+    QFETCH(bool, reversed);
+
+    // A 64 MiB file in 4 KiB chunks
+    const quint32 chunkSize = 4096;
+    const quint32 chunksCount = 16384;
+    const QByteArray chunk(static_cast<int>(chunkSize), 'x');
+    QBENCHMARK {
+        FileInfo info = createStreamedInfo(chunkSize * chunksCount);
+        for (quint32 i = 0; i < chunksCount; ++i) {
+            const quint32 index = reversed ? (chunksCount - 1 - i) : i;
+            info.addData(index * chunkSize, chunk);
+        }
+        QVERIFY(info.isCovered());
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_FileInfo)
+
+#include "tst_fileinfo.moc"
@@ -0,0 +1,186 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "handleregistry.hpp"
+
+#include <QTest>
+
+class tst_HandleRegistry : public QObject
+{
+    Q_OBJECT
+private slots:
+    void ensureHandle();
+    void invalidPeer();
+    void identifiers();
+    void setPeer();
+    void benchmarkEnsureHandle_data();
+    void benchmarkEnsureHandle();
+    void benchmarkLookup_data();
+    void benchmarkLookup();
+    void benchmarkIdentifier_data();
+    void benchmarkIdentifier();
+
+private:
+    static void addPeersCountRows();
+    static MorseHandleRegistry createRegistry(quint32 count);
+};
+
+void tst_HandleRegistry::addPeersCountRows()
+{
+    QTest::addColumn<quint32>("peersCount");
+    QTest::newRow("1k") << 1000u;
+    QTest::newRow("10k") << 10000u;
+    QTest::newRow("100k") << 100000u;
+    QTest::newRow("1M") << 1000000u;
+}
+
+MorseHandleRegistry tst_HandleRegistry::createRegistry(quint32 count)
+{
+    MorseHandleRegistry registry;
+    for (quint32 i = 1; i <= count; ++i) {
+        registry.ensureHandle(Telegram::Peer::fromUserId(i));
+    }
+    return registry;
+}
+
+void tst_HandleRegistry::ensureHandle()
+{
+    MorseHandleRegistry registry;
+    QVERIFY(registry.isEmpty());
+
+    const Telegram::Peer user = Telegram::Peer::fromUserId(10);
+    const Telegram::Peer chat = Telegram::Peer::fromChatId(10);
+
+    const uint userHandle = registry.ensureHandle(user);
+    const uint chatHandle = registry.ensureHandle(chat);
+    QCOMPARE(userHandle, 1u);
+    QCOMPARE(chatHandle, 2u); // Same id, different peer type
+    QCOMPARE(registry.ensureHandle(user), userHandle);
+    QCOMPARE(registry.lastHandle(), 2u);
+
+    QCOMPARE(registry.handle(user), userHandle);
+    QCOMPARE(registry.handle(chat), chatHandle);
+    QCOMPARE(registry.peer(userHandle), user);
+    QCOMPARE(registry.peer(chatHandle), chat);
+
+    QVERIFY(registry.contains(chatHandle));
+    QVERIFY(!registry.contains(0));
+    QVERIFY(!registry.contains(3));
+    QCOMPARE(registry.handle(Telegram::Peer::fromUserId(11)), 0u);
+    QVERIFY(!registry.peer(3).isValid());
+}
+
+void tst_HandleRegistry::invalidPeer()
+{
+    MorseHandleRegistry registry;
+    QCOMPARE(registry.ensureHandle(Telegram::Peer()), 0u);
+    QVERIFY(registry.isEmpty());
+    QCOMPARE(registry.handle(Telegram::Peer()), 0u);
+}
+
+void tst_HandleRegistry::identifiers()
+{
+    MorseHandleRegistry registry;
+    const Telegram::Peer user = Telegram::Peer::fromUserId(42);
+    const uint handle = registry.ensureHandle(user);
+
+    QCOMPARE(registry.identifier(handle), user.toString());
+    QCOMPARE(registry.handle(user.toString()), handle);
+    QCOMPARE(registry.identifier(handle + 1), QString());
+    QCOMPARE(registry.handle(Telegram::Peer::fromUserId(43).toString()), 0u);
+}
+
+void tst_HandleRegistry::setPeer()
+{
+    MorseHandleRegistry registry;
+
+    // The self handle is allocated before the self peer is known
+    registry.setPeer(1, Telegram::Peer());
+    QCOMPARE(registry.lastHandle(), 1u);
+    QCOMPARE(registry.identifier(1), QString());
+
+    const Telegram::Peer self = Telegram::Peer::fromUserId(7);
+    registry.setPeer(1, self);
+    QCOMPARE(registry.handle(self), 1u);
+    QCOMPARE(registry.handle(self.toString()), 1u);
+    QCOMPARE(registry.ensureHandle(self), 1u);
+
+    const Telegram::Peer other = Telegram::Peer::fromUserId(8);
+    registry.setPeer(1, other);
+    QCOMPARE(registry.handle(self), 0u);
+    QCOMPARE(registry.handle(self.toString()), 0u);
+    QCOMPARE(registry.handle(other), 1u);
+
+    // The next handle is allocated after the bound one
+    QCOMPARE(registry.ensureHandle(self), 2u);
+}
+
+void tst_HandleRegistry::benchmarkEnsureHandle_data()
+{
+    addPeersCountRows();
+}
+
+void tst_HandleRegistry::benchmarkEnsureHandle()
+{
+    QFETCH(quint32, peersCount);
+    QBENCHMARK {
+        const MorseHandleRegistry registry = createRegistry(peersCount);
+        QCOMPARE(registry.lastHandle(), peersCount);
+    }
+}
+
+void tst_HandleRegistry::benchmarkLookup_data()
+{
+    addPeersCountRows();
+}
+
+void tst_HandleRegistry::benchmarkLookup()
+{
+    QFETCH(quint32, peersCount);
+    MorseHandleRegistry registry = createRegistry(peersCount);
+    QBENCHMARK {
+        // A known sender of each message
+        for (quint32 i = 1; i <= peersCount; ++i) {
+            registry.ensureHandle(Telegram::Peer::fromUserId(i));
+        }
+    }
+}
+
+void tst_HandleRegistry::benchmarkIdentifier_data()
+{
+    addPeersCountRows();
+}
+
+void tst_HandleRegistry::benchmarkIdentifier()
+{
+    QFETCH(quint32, peersCount);
+    // The InspectHandles path
+    const MorseHandleRegistry registry = createRegistry(peersCount);
+    int totalLength = 0;
+    QBENCHMARK {
+        for (uint handle = 1; handle <= peersCount; ++handle) {
+            totalLength += registry.identifier(handle).length();
+        }
+    }
+    QVERIFY(totalLength > 0);
+}
+
+QTEST_APPLESS_MAIN(tst_HandleRegistry)
+
+#include "tst_handleregistry.moc"
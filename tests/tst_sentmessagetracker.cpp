@@ -0,0 +1,129 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "sentmessagetracker.hpp"
+
+#include <QTest>
+
+class tst_SentMessageTracker : public QObject
+{
+    Q_OBJECT
+private slots:
+    void resolveAndRead();
+    void unknownMessage();
+    void resolveTwice();
+    void eviction();
+    void benchmarkSendAndRead();
+};
+
+static const int c_benchmarkMessagesCount = 100000;
+
+void tst_SentMessageTracker::resolveAndRead()
+{
+    MorseSentMessageTracker tracker;
+    tracker.addMessage(1001);
+    tracker.addMessage(1002);
+    tracker.addMessage(1003);
+    QCOMPARE(tracker.count(), 3);
+
+    // Resolved out of order
+    QVERIFY(tracker.setMessageId(1002, 11));
+    QVERIFY(tracker.setMessageId(1001, 10));
+    QVERIFY(tracker.setMessageId(1003, 12));
+
+    QCOMPARE(tracker.takeMessagesUpTo(9), QVector<quint64>());
+    QCOMPARE(tracker.takeMessagesUpTo(11), QVector<quint64>() << 1001 << 1002);
+    QCOMPARE(tracker.count(), 1);
+    QCOMPARE(tracker.takeMessagesUpTo(11), QVector<quint64>());
+    QCOMPARE(tracker.takeMessagesUpTo(20), QVector<quint64>() << 1003);
+    QCOMPARE(tracker.count(), 0);
+}
+
+void tst_SentMessageTracker::unknownMessage()
+{
+    MorseSentMessageTracker tracker;
+    QVERIFY(!tracker.setMessageId(1001, 10));
+    QCOMPARE(tracker.takeMessagesUpTo(10), QVector<quint64>());
+
+    // Not resolved yet, so can not be read
+    tracker.addMessage(1001);
+    QCOMPARE(tracker.takeMessagesUpTo(100), QVector<quint64>());
+    QCOMPARE(tracker.count(), 1);
+}
+
+void tst_SentMessageTracker::resolveTwice()
+{
+    MorseSentMessageTracker tracker;
+    tracker.addMessage(1001);
+    QVERIFY(tracker.setMessageId(1001, 10));
+    QVERIFY(tracker.setMessageId(1001, 20));
+    QCOMPARE(tracker.takeMessagesUpTo(10), QVector<quint64>());
+    QCOMPARE(tracker.takeMessagesUpTo(20), QVector<quint64>() << 1001);
+}
+
+void tst_SentMessageTracker::eviction()
+{
+    MorseSentMessageTracker tracker;
+    tracker.setMaximumCount(2);
+    QCOMPARE(tracker.maximumCount(), 2);
+
+    tracker.addMessage(1001);
+    tracker.addMessage(1002);
+    tracker.setMessageId(1001, 10);
+    tracker.setMessageId(1002, 11);
+    tracker.addMessage(1003);
+    QCOMPARE(tracker.count(), 2);
+
+    // The oldest message is forgotten
+    QVERIFY(!tracker.setMessageId(1001, 10));
+    tracker.setMessageId(1003, 12);
+    QCOMPARE(tracker.takeMessagesUpTo(12), QVector<quint64>() << 1002 << 1003);
+
+    // The read messages do not count
+    tracker.addMessage(1004);
+    tracker.addMessage(1005);
+    QCOMPARE(tracker.count(), 2);
+    QVERIFY(tracker.setMessageId(1004, 13));
+
+    tracker.setMaximumCount(1);
+    QCOMPARE(tracker.count(), 1);
+    QVERIFY(!tracker.setMessageId(1004, 13));
+    QVERIFY(tracker.setMessageId(1005, 14));
+}
+
+void tst_SentMessageTracker::benchmarkSendAndRead()
+{
+    QBENCHMARK {
+        MorseSentMessageTracker tracker;
+        tracker.setMaximumCount(c_benchmarkMessagesCount);
+        for (int i = 1; i <= c_benchmarkMessagesCount; ++i) {
+            tracker.addMessage(static_cast<quint64>(i) << 32);
+            tracker.setMessageId(static_cast<quint64>(i) << 32, static_cast<quint32>(i));
+            if ((i % 100) == 0) {
+                // A read report for every hundred messages
+                tracker.takeMessagesUpTo(static_cast<quint32>(i));
+            }
+        }
+        QCOMPARE(tracker.count(), 0);
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_SentMessageTracker)
+
+#include "tst_sentmessagetracker.moc"
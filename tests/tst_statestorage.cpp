@@ -0,0 +1,206 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "statestorage.hpp"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <algorithm>
+
+class tst_StateStorage : public QObject
+{
+    Q_OBJECT
+private slots:
+    void init();
+    void replay();
+    void tornTail();
+    void unsupportedFile();
+    void compaction();
+    void benchmarkLoad();
+    void benchmarkFlush();
+
+private:
+    QString m_fileName;
+    QScopedPointer<QTemporaryDir> m_dir;
+};
+
+static const quint32 c_benchmarkContactsCount = 10000;
+
+static QVector<Telegram::Peer> sortedContacts(const MorseStateStorage &storage)
+{
+    QVector<Telegram::Peer> result = storage.contactList();
+    std::sort(result.begin(), result.end(), [](const Telegram::Peer &left, const Telegram::Peer &right) {
+        return (left.type < right.type) || ((left.type == right.type) && (left.id < right.id));
+    });
+    return result;
+}
+
+void tst_StateStorage::init()
+{
+    m_dir.reset(new QTemporaryDir());
+    QVERIFY(m_dir->isValid());
+    m_fileName = m_dir->path() + QLatin1String("/state");
+}
+
+void tst_StateStorage::replay()
+{
+    const Telegram::Peer user1 = Telegram::Peer::fromUserId(1);
+    const Telegram::Peer user2 = Telegram::Peer::fromUserId(2);
+    const Telegram::Peer chat = Telegram::Peer::fromChatId(1);
+
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    QVERIFY(!storage.load()); // No file yet
+    storage.setContact(user1, QLatin1String("First"));
+    storage.setContact(user2, QLatin1String("Second"));
+    QVERIFY(storage.flush());
+
+    // Appended to the existing log
+    storage.setContact(user1, QLatin1String("First renamed"));
+    storage.removeContact(user2);
+    storage.setContact(chat, QString());
+    QVERIFY(storage.flush());
+
+    MorseStateStorage loaded;
+    loaded.setFileName(m_fileName);
+    QVERIFY(loaded.load());
+    QCOMPARE(sortedContacts(loaded), QVector<Telegram::Peer>() << user1 << chat);
+    QCOMPARE(loaded.alias(user1), QStringLiteral("First renamed"));
+    QCOMPARE(loaded.alias(user2), QString());
+}
+
+void tst_StateStorage::tornTail()
+{
+    const Telegram::Peer user1 = Telegram::Peer::fromUserId(1);
+    const Telegram::Peer user2 = Telegram::Peer::fromUserId(2);
+
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    storage.setContact(user1, QLatin1String("First"));
+    QVERIFY(storage.flush());
+
+    // The process was killed in the middle of a record write
+    {
+        QFile file(m_fileName);
+        QVERIFY(file.open(QIODevice::WriteOnly|QIODevice::Append));
+        file.write(QByteArray::fromHex("0101000000"));
+    }
+
+    MorseStateStorage loaded;
+    loaded.setFileName(m_fileName);
+    QVERIFY(loaded.load());
+    QCOMPARE(loaded.contactList(), QVector<Telegram::Peer>() << user1);
+
+    // The broken tail is dropped, so the new records are readable
+    loaded.setContact(user2, QLatin1String("Second"));
+    QVERIFY(loaded.flush());
+
+    MorseStateStorage reloaded;
+    reloaded.setFileName(m_fileName);
+    QVERIFY(reloaded.load());
+    QCOMPARE(sortedContacts(reloaded), QVector<Telegram::Peer>() << user1 << user2);
+    QCOMPARE(reloaded.alias(user2), QStringLiteral("Second"));
+}
+
+void tst_StateStorage::unsupportedFile()
+{
+    {
+        QFile file(m_fileName);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write("{ \"contacts\": [] }");
+    }
+
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    QVERIFY(!storage.load());
+    QVERIFY(storage.contactList().isEmpty());
+
+    // The file is rewritten, not appended to
+    const Telegram::Peer user = Telegram::Peer::fromUserId(1);
+    storage.setContact(user, QLatin1String("First"));
+    QVERIFY(storage.flush());
+
+    MorseStateStorage loaded;
+    loaded.setFileName(m_fileName);
+    QVERIFY(loaded.load());
+    QCOMPARE(loaded.contactList(), QVector<Telegram::Peer>() << user);
+}
+
+void tst_StateStorage::compaction()
+{
+    const Telegram::Peer user = Telegram::Peer::fromUserId(1);
+
+    MorseStateStorage reference;
+    reference.setFileName(m_dir->path() + QLatin1String("/reference"));
+    reference.setContact(user, QLatin1String("Alias 1000"));
+    QVERIFY(reference.flush());
+
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    for (int i = 0; i <= 1000; ++i) {
+        storage.setContact(user, QStringLiteral("Alias %1").arg(i));
+    }
+    QVERIFY(storage.flush());
+
+    // A single record is left
+    QCOMPARE(QFileInfo(m_fileName).size(), QFileInfo(reference.fileName()).size());
+
+    MorseStateStorage loaded;
+    loaded.setFileName(m_fileName);
+    QVERIFY(loaded.load());
+    QCOMPARE(loaded.alias(user), QStringLiteral("Alias 1000"));
+}
+
+void tst_StateStorage::benchmarkLoad()
+{
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    for (quint32 i = 1; i <= c_benchmarkContactsCount; ++i) {
+        storage.setContact(Telegram::Peer::fromUserId(i), QStringLiteral("Contact %1").arg(i));
+    }
+    QVERIFY(storage.flush());
+
+    QBENCHMARK {
+        MorseStateStorage loaded;
+        loaded.setFileName(m_fileName);
+        QVERIFY(loaded.load());
+        QCOMPARE(static_cast<quint32>(loaded.contactList().count()), c_benchmarkContactsCount);
+    }
+}
+
+void tst_StateStorage::benchmarkFlush()
+{
+    MorseStateStorage storage;
+    storage.setFileName(m_fileName);
+    quint32 alias = 0;
+    QBENCHMARK {
+        // A roster update with a hundred of changed contacts
+        for (quint32 i = 1; i <= 100; ++i) {
+            storage.setContact(Telegram::Peer::fromUserId(i), QString::number(++alias));
+        }
+        QVERIFY(storage.flush());
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_StateStorage)
+
+#include "tst_statestorage.moc"
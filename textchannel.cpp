@@ -19,6 +19,10 @@
 
 #include "textchannel.hpp"
 #include "connection.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+#include "extras/CFileManager.hpp"
 
 #include <TelegramQt/Client>
 #include <TelegramQt/DataStorage>
@@ -31,7 +35,26 @@
 
 #include <QVariantMap>
 #include <QDateTime>
+#include <QFile>
+#include <QMimeDatabase>
 #include <QTimer>
+#include <QUrl>
+
+#include <algorithm>
+
+// Message part keys, shared by all the messages
+static const QString c_messageTokenKey = QStringLiteral("message-token");
+static const QString c_messageTypeKey = QStringLiteral("message-type");
+static const QString c_messageSentKey = QStringLiteral("message-sent");
+static const QString c_messageReceivedKey = QStringLiteral("message-received");
+static const QString c_messageSenderKey = QStringLiteral("message-sender");
+static const QString c_messageSenderIdKey = QStringLiteral("message-sender-id");
+static const QString c_deliveryStatusKey = QStringLiteral("delivery-status");
+static const QString c_deliveryTokenKey = QStringLiteral("delivery-token");
+static const QString c_scrollbackKey = QStringLiteral("scrollback");
+static const QString c_contentTypeKey = QStringLiteral("content-type");
+static const QString c_contentKey = QStringLiteral("content");
+static const QString c_plainTextType = QStringLiteral("text/plain");
 
 QString userToVCard(const Telegram::UserInfo &userInfo)
 {
@@ -93,8 +116,12 @@ MorseTextChannel::MorseTextChannel(MorseConnection *morseConnection, Tp::BaseCha
     m_chatStateIface->setSetChatStateCallback(Tp::memFun(this, &MorseTextChannel::setChatState));
     baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(m_chatStateIface));
 
-    connect(m_api, &Telegram::Client::MessagingApi::messageActionChanged,
-            this, &MorseTextChannel::onMessageActionChanged);
+    Telegram::DialogInfo dialogInfo;
+    if (m_client->dataStorage()->getDialogInfo(&dialogInfo, m_targetPeer)) {
+        m_readInboxMaxId = dialogInfo.readInboxMaxId();
+        m_readOutboxMaxId = dialogInfo.readOutboxMaxId();
+    }
+    updateMessageHeaders();
 
     if (m_targetHandleType == Tp::HandleTypeRoom) {
 #ifdef ENABLE_GROUP_CHAT
@@ -108,6 +135,10 @@ MorseTextChannel::MorseTextChannel(MorseConnection *morseConnection, Tp::BaseCha
         m_groupIface->setSelfHandle(m_connection->selfHandle());
         baseChannel->plugInterface(Tp::AbstractChannelInterfacePtr::dynamicCast(m_groupIface));
 
+        // The rest of the participants are added as they show up in the chat
+        m_participants.insert(m_connection->selfHandle());
+        addChatParticipants(Tp::UIntList() << m_connection->selfHandle());
+
         Telegram::ChatInfo info;
         m_client->dataStorage()->getChatInfo(&info, m_targetPeer);
 
@@ -130,12 +161,8 @@ MorseTextChannel::MorseTextChannel(MorseConnection *morseConnection, Tp::BaseCha
 #endif
     }
 
-    // connect(m_core, SIGNAL(messageReadInbox(Telegram::Peer,quint32)),
-    //         SLOT(setMessageInboxRead(Telegram::Peer,quint32)));
-    // connect(m_core, SIGNAL(messageReadOutbox(Telegram::Peer,quint32)),
-    //         SLOT(setMessageOutboxRead(Telegram::Peer,quint32)));
-    connect(m_client->messagingApi(), &Telegram::Client::MessagingApi::messageSent,
-            this, &MorseTextChannel::setResolvedMessageId);
+    // MessagingApi::messageActionChanged, messageSent, messageReadInbox and messageReadOutbox,
+    // as well as the media downloads (see requestMediaFile()) are routed by MorseConnection
 }
 
 MorseTextChannelPtr MorseTextChannel::create(MorseConnection *morseConnection, Tp::BaseChannel *baseChannel)
@@ -145,10 +172,15 @@ MorseTextChannelPtr MorseTextChannel::create(MorseConnection *morseConnection, T
 
 MorseTextChannel::~MorseTextChannel()
 {
+    // The held messages are dropped along with the channel
+    for (const QString &uniqueId : m_mediaRequestMessages.uniqueKeys()) {
+        m_connection->removeMediaRequest(uniqueId, this);
+    }
 }
 
 QString MorseTextChannel::sendMessageCallback(const Tp::MessagePartList &messageParts, uint flags, Tp::DBusError *error)
 {
+    MorseMetrics::ScopedTimer timer(MorseMetrics::MessageSendTime);
     QString content;
     for (const Tp::MessagePart &part : messageParts) {
         if (part.contains(QLatin1String("content-type"))
@@ -160,24 +192,21 @@ QString MorseTextChannel::sendMessageCallback(const Tp::MessagePartList &message
     }
 
     quint64 tmpId = m_api->sendMessage(m_targetPeer, content);
-    m_sentMessageIds.append(SentMessageId(tmpId));
+    m_sentMessages.addMessage(tmpId);
+    MorseMetrics::increment(tmpId ? MorseMetrics::MessagesSent : MorseMetrics::MessagesSendFailed);
 
     return QString::number(tmpId);
 }
 
 void MorseTextChannel::messageAcknowledgedCallback(const QString &messageId)
 {
-    m_api->readHistory(m_targetPeer, messageId.toUInt());
-}
-
-void MorseTextChannel::onMessageActionChanged(const Telegram::Peer &peer, quint32 userId, TelegramNamespace::MessageAction action)
-{
-    // We are connected to broadcast signal, so have to select only needed calls
-    const Telegram::Peer identifier = peer;
-    if (identifier != m_targetPeer) {
+    const quint32 id = messageId.toUInt();
+    m_pendingMessageTokens.remove(id);
+    if (m_acknowledgingReadMessages) {
+        // The messages are read on the server side already
         return;
     }
-    setMessageAction(userId, action);
+    m_api->readHistory(m_targetPeer, id);
 }
 
 void MorseTextChannel::setMessageAction(quint32 userId, TelegramNamespace::MessageAction action)
@@ -188,70 +217,61 @@ void MorseTextChannel::setMessageAction(quint32 userId, TelegramNamespace::Messa
     } else {
         m_chatStateIface->chatStateChanged(handle, Tp::ChannelChatStateActive);
     }
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
 }
 
 void MorseTextChannel::onMessageReceived(const Telegram::Message &message)
 {
+    MORSE_TRACE_SCOPE("MorseTextChannel::onMessageReceived");
     Tp::MessagePartList partList;
-    Tp::MessagePart header;
-
-    const QString token = QString::number(message.id);
-    header[QLatin1String("message-token")] = QDBusVariant(token);
-    header[QLatin1String("message-type")]  = QDBusVariant(Tp::ChannelTextMessageTypeNormal);
-    header[QLatin1String("message-sent")]  = QDBusVariant(message.timestamp);
 
-    bool broadcast = false;
-    bool isOut = message.flags & TelegramNamespace::MessageFlagOut;
-
-    if (m_targetPeer.type == Telegram::Peer::Channel) {
-        Telegram::ChatInfo info;
-        if (!m_client->dataStorage()->getChatInfo(&info, m_targetPeer.id)) {
-            qWarning() << "Unable to get chat info" << m_targetPeer.toString();
-        }
-        broadcast = info.broadcast();
-    }
+    const bool isOut = message.flags & TelegramNamespace::MessageFlagOut;
 
-    if (broadcast) {
-        header[QLatin1String("message-sender")]    = QDBusVariant(m_targetHandle);
-        header[QLatin1String("message-sender-id")] = QDBusVariant(m_targetPeer.toString());
-    } else if (isOut) {
-        header[QLatin1String("message-sender")]    = QDBusVariant(m_connection->selfHandle());
-        header[QLatin1String("message-sender-id")] = QDBusVariant(m_connection->selfID());
-    } else {
+    // The sender of outgoing and broadcast messages is known in advance
+    Tp::MessagePart header = isOut ? m_outgoingHeader : m_incomingHeader;
+    if (!m_broadcast && !isOut) {
         const Telegram::Peer senderId = Telegram::Peer::fromUserId(message.fromId);
-        header[QLatin1String("message-sender")]    = QDBusVariant(m_connection->ensureHandle(senderId));
-        header[QLatin1String("message-sender-id")] = QDBusVariant(senderId.toString());
+        const uint senderHandle = m_connection->ensureContact(senderId);
+        header[c_messageSenderKey]   = QDBusVariant(senderHandle);
+        header[c_messageSenderIdKey] = QDBusVariant(m_connection->contactIdentifier(senderHandle));
+
+        if (senderHandle && (m_targetHandleType == Tp::HandleTypeRoom) && !m_participants.contains(senderHandle)) {
+            // Committed once per batch of messages, see commitParticipants()
+            m_participants.insert(senderHandle);
+            m_addedParticipants.append(senderHandle);
+        }
     }
 
-    Telegram::DialogInfo dialogInfo;
-    m_client->dataStorage()->getDialogInfo(&dialogInfo, m_targetPeer);
+    const QString token = QString::number(message.id);
+    header[c_messageTokenKey] = QDBusVariant(token);
+    header[c_messageSentKey]  = QDBusVariant(message.timestamp);
 
     const bool isRead = isOut
-            ? (dialogInfo.readOutboxMaxId() >= message.id)
-            : (dialogInfo.readInboxMaxId() >= message.id);
+            ? (m_readOutboxMaxId >= message.id)
+            : (m_readInboxMaxId >= message.id);
 
-    header[QLatin1String("delivery-status")] = QDBusVariant(isRead
-                                                            ? Tp::DeliveryStatusRead
-                                                            : Tp::DeliveryStatusAccepted);
+    header[c_deliveryStatusKey] = QDBusVariant(isRead
+                                               ? Tp::DeliveryStatusRead
+                                               : Tp::DeliveryStatusAccepted);
 
     const bool scrollback = isRead || isOut;
     if (scrollback) {
-        header[QLatin1String("scrollback")] = QDBusVariant(true);
+        header[c_scrollbackKey] = QDBusVariant(true);
         // Telegram has no timestamp for message read, only sent.
         // Fallback to the message sent timestamp to keep received messages in chronological order.
         // Alternatively, client can sort messages in order of message-sent.
-        header[QLatin1String("message-received")]  = QDBusVariant(message.timestamp);
+        header[c_messageReceivedKey] = QDBusVariant(message.timestamp);
     } else {
         uint currentTimestamp = static_cast<uint>(QDateTime::currentMSecsSinceEpoch() / 1000ll);
-        header[QLatin1String("message-received")]  = QDBusVariant(currentTimestamp);
+        header[c_messageReceivedKey] = QDBusVariant(currentTimestamp);
     }
     partList << header;
 
     Tp::MessagePartList body;
     if (!message.text.isEmpty()) {
         Tp::MessagePart text;
-        text[QLatin1String("content-type")] = QDBusVariant(QLatin1String("text/plain"));
-        text[QLatin1String("content")] = QDBusVariant(message.text);
+        text[c_contentTypeKey] = QDBusVariant(c_plainTextType);
+        text[c_contentKey] = QDBusVariant(message.text);
         body << text;
     }
 
@@ -273,13 +293,13 @@ void MorseTextChannel::onMessageReceived(const Telegram::Message &message)
         case TelegramNamespace::MessageTypeContact: {
             Telegram::UserInfo userInfo;
             if (!info.getContactInfo(&userInfo)) {
-                qWarning() << Q_FUNC_INFO << "Unable to get user info from contact media message" << message.id;
+                qCWarning(lcMorseChannel) << Q_FUNC_INFO << "Unable to get user info from contact media message" << message.id;
                 break;
             }
 
             QString data = userToVCard(userInfo);
             if (data.isEmpty()) {
-                qWarning() << Q_FUNC_INFO << "Unable to get user vcard from user info from message" << message.id;
+                qCWarning(lcMorseChannel) << Q_FUNC_INFO << "Unable to get user vcard from user info from message" << message.id;
                 break;
             }
             Tp::MessagePart userVCardPart;
@@ -301,6 +321,12 @@ void MorseTextChannel::onMessageReceived(const Telegram::Message &message)
             body << webPart;
         }
             break;
+        case TelegramNamespace::MessageTypePhoto:
+        case TelegramNamespace::MessageTypeAudio:
+        case TelegramNamespace::MessageTypeVideo:
+        case TelegramNamespace::MessageTypeDocument:
+            handled = addMediaFilePart(&body, info);
+            break;
         default:
             handled = false;
             break;
@@ -348,126 +374,268 @@ void MorseTextChannel::onMessageReceived(const Telegram::Message &message)
     }
 
     partList << body;
+    m_pendingMessageTokens.insert(message.id, token);
+
+    MORSE_TRACE_SCOPE("MorseTextChannel::addReceivedMessage");
     addReceivedMessage(partList);
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+    MorseMetrics::increment(MorseMetrics::MessageReceivedSignals);
 }
 
-void MorseTextChannel::updateChatParticipants(const Tp::UIntList &handles)
+QString MorseTextChannel::requestMediaFile(const Telegram::Message &message)
 {
-#ifdef ENABLE_GROUP_CHAT
-    m_groupIface->setMembers(handles, /* details */ QVariantMap());
-#else
-    Q_UNUSED(handles)
-#endif
-}
+    switch (message.type) {
+    case TelegramNamespace::MessageTypePhoto:
+    case TelegramNamespace::MessageTypeAudio:
+    case TelegramNamespace::MessageTypeVideo:
+    case TelegramNamespace::MessageTypeDocument:
+        break;
+    default:
+        return QString();
+    }
 
-void MorseTextChannel::onChatDetailsChanged(quint32 chatId, const Tp::UIntList &handles)
-{
-    qDebug() << Q_FUNC_INFO << chatId;
+    const quint32 limit = m_connection->mediaDownloadLimit();
+    if (!limit) {
+        return QString();
+    }
 
-    if (m_targetPeer.id == chatId) {
-        updateChatParticipants(handles);
+    Telegram::MessageMediaInfo info;
+    m_client->dataStorage()->getMessageMediaInfo(&info, message.peer(), message.id);
+    Telegram::RemoteFile file;
+    if (!info.getRemoteFileInfo(&file) || (file.size() > limit) || (file.size() > m_connection->mediaCache()->maximumSize())) {
+        return QString();
+    }
 
-        Telegram::ChatInfo info;
-        if (m_client->dataStorage()->getChatInfo(&info, chatId)) {
-            m_roomConfigIface->setTitle(info.title());
-            m_roomConfigIface->setConfigurationRetrieved(true);
-        }
+    // The file is downloaded straight to the disk cache,
+    // so neither the memory usage nor the D-Bus message size depends on the media size.
+    CFileManager *fileManager = m_connection->fileManager();
+    const QString uniqueId = fileManager->requestFile(file, CFileManager::PriorityLow, CFileManager::StorageFile);
+    const FileInfo *fileInfo = fileManager->getFileInfo(uniqueId);
+    if (!fileInfo) {
+        return QString();
     }
+    if (fileInfo->isComplete()) {
+        // Found on the disk, nothing to wait for
+        fileManager->releaseFile(uniqueId);
+        return QString();
+    }
+    m_connection->addMediaRequest(uniqueId, this);
+    return uniqueId;
 }
 
-void MorseTextChannel::setMessageInboxRead(Telegram::Peer peer, quint32 messageId)
+bool MorseTextChannel::addMediaFilePart(Tp::MessagePartList *body, const Telegram::MessageMediaInfo &info)
 {
-    // We are connected to broadcast signal, so have to select only needed calls
-    if (m_targetPeer != peer) {
-        return;
+    Telegram::RemoteFile file;
+    if (!info.getRemoteFileInfo(&file)) {
+        return false;
     }
 
-    // TODO: Mark *all* messages up to this as read
-    QStringList tokens;
+    // Only a downloaded file is referenced, see requestMediaFile()
+    const QString uniqueId = file.getUniqueId();
+    const QString fileName = m_connection->fileManager()->getFilePath(uniqueId);
+    if (fileName.isEmpty() || !QFile::exists(fileName)) {
+        return false;
+    }
+    m_connection->mediaCache()->markUsed(uniqueId);
+
+    QString mimeType = info.mimeType();
+    if (mimeType.isEmpty()) {
+        mimeType = QMimeDatabase().mimeTypeForFile(fileName).name();
+    }
+
+    Tp::MessagePart filePart;
+    filePart[QLatin1String("content-type")] = QDBusVariant(mimeType);
+    filePart[QLatin1String("alternative")] = QDBusVariant(QLatin1String("multimedia"));
+    filePart[QLatin1String("identifier")] = QDBusVariant(uniqueId);
+    filePart[QLatin1String("size")] = QDBusVariant(file.size());
+    filePart[QLatin1String("url")] = QDBusVariant(QUrl::fromLocalFile(fileName).toString());
+    *body << filePart;
+    return true;
+}
 
-    foreach (const Tp::MessagePartList &message, pendingMessages()) {
-        if (message.isEmpty()) {
-            // Invalid message
+void MorseTextChannel::addMessages(const QVector<Telegram::Message> &messages)
+{
+    for (const Telegram::Message &message : messages) {
+        if (m_pendingMessageTokens.contains(message.id) || m_heldMessages.contains(message.id)) {
+            // Delivered already (the live update and the history sync may overlap)
             continue;
         }
-        const Tp::MessagePart &header = message.front();
-        bool ok;
-        const QString token = header.value(QLatin1String("message-token")).variant().toString();
-        quint32 mId = token.toUInt(&ok);
-        if (!ok) {
-            // Invalid message token
+        const QString mediaFileId = requestMediaFile(message);
+        if (!mediaFileId.isEmpty()) {
+            m_messagesWaitingForMedia.insert(message.id);
+            m_mediaRequestMessages.insert(mediaFileId, message.id);
+        }
+        if (!mediaFileId.isEmpty() || !m_heldMessages.isEmpty()) {
+            // Keep the server order: the later messages wait for the media of the earlier ones
+            m_heldMessages.insert(message.id, message);
             continue;
         }
+        onMessageReceived(message);
+    }
 
-        if (mId <= messageId) {
-            tokens.append(token);
-        }
+    commitParticipants();
+}
+
+void MorseTextChannel::onMediaFileRequestFinished(const QString &uniqueId)
+{
+    const QList<quint32> messageIds = m_mediaRequestMessages.values(uniqueId);
+    if (messageIds.isEmpty()) {
+        return;
     }
+    m_mediaRequestMessages.remove(uniqueId);
+    for (const quint32 messageId : messageIds) {
+        m_messagesWaitingForMedia.remove(messageId);
+    }
+    deliverHeldMessages();
+}
 
-#if TP_QT_VERSION >= TP_QT_VERSION_CHECK(0, 9, 8)
-    Tp::DBusError error;
-    acknowledgePendingMessages(tokens, &error);
+void MorseTextChannel::deliverHeldMessages()
+{
+    // On a failure the messages are delivered without the file part
+    while (!m_heldMessages.isEmpty() && !m_messagesWaitingForMedia.contains(m_heldMessages.firstKey())) {
+        const Telegram::Message message = m_heldMessages.take(m_heldMessages.firstKey());
+        onMessageReceived(message);
+    }
+    commitParticipants();
+}
+
+void MorseTextChannel::commitParticipants()
+{
+    if (!m_addedParticipants.isEmpty()) {
+        MORSE_TRACE_SCOPE("MorseTextChannel::addChatParticipants");
+        addChatParticipants(m_addedParticipants);
+        m_addedParticipants.clear();
+    }
+}
+
+void MorseTextChannel::addChatParticipants(const Tp::UIntList &addedHandles)
+{
+#ifdef ENABLE_GROUP_CHAT
+    // The group interface has no incremental setter; it diffs the new list
+    // against its current members and signals only the added handles.
+    m_groupIface->setMembers(m_groupIface->members() + addedHandles, /* details */ QVariantMap());
+#else
+    Q_UNUSED(addedHandles)
 #endif
 }
 
-void MorseTextChannel::setMessageOutboxRead(Telegram::Peer peer, quint32 messageId)
+/**
+ * Reread the chat info (the title and the broadcast flag) from the data storage.
+ */
+void MorseTextChannel::refreshChatInfo()
 {
-    // We are connected to broadcast signal, so have to select only needed calls
-    if (m_targetPeer != peer) {
+    if (m_targetPeer.type == Telegram::Peer::User) {
         return;
     }
 
-    quint64 id = messageId;
-    foreach (const SentMessageId &info, m_sentMessageIds) {
-        if (info.id == messageId) {
-            id = info.randomId;
-            break;
+    Telegram::ChatInfo info;
+    if (m_roomConfigIface && m_client->dataStorage()->getChatInfo(&info, m_targetPeer)) {
+        m_roomConfigIface->setTitle(info.title());
+        m_roomConfigIface->setConfigurationRetrieved(true);
+    }
+    updateMessageHeaders();
+}
+
+void MorseTextChannel::updateMessageHeaders()
+{
+    if (m_targetPeer.type == Telegram::Peer::Channel) {
+        Telegram::ChatInfo info;
+        if (!m_client->dataStorage()->getChatInfo(&info, m_targetPeer.id)) {
+            qCWarning(lcMorseChannel) << "Unable to get chat info" << m_targetPeer.toString();
         }
+        m_broadcast = info.broadcast();
     }
 
-    // TODO: Mark *all* messages up to this as read
+    m_incomingHeader.clear();
+    m_incomingHeader[c_messageTypeKey] = QDBusVariant(Tp::ChannelTextMessageTypeNormal);
+    if (m_broadcast) {
+        // Posts are attributed to the channel itself
+        m_incomingHeader[c_messageSenderKey]   = QDBusVariant(m_targetHandle);
+        m_incomingHeader[c_messageSenderIdKey] = QDBusVariant(m_targetPeer.toString());
+        m_outgoingHeader = m_incomingHeader;
+    } else {
+        m_outgoingHeader = m_incomingHeader;
+        m_outgoingHeader[c_messageSenderKey]   = QDBusVariant(m_connection->selfHandle());
+        m_outgoingHeader[c_messageSenderIdKey] = QDBusVariant(m_connection->selfID());
+    }
 
-    const QString token = QString::number(id);
+    m_readReportHeader.clear();
+    m_readReportHeader[c_messageSenderKey]   = QDBusVariant(m_connection->selfHandle());
+    m_readReportHeader[c_messageSenderIdKey] = QDBusVariant(m_connection->selfID());
+    m_readReportHeader[c_messageTypeKey]     = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
+    m_readReportHeader[c_deliveryStatusKey]  = QDBusVariant(Tp::DeliveryStatusRead);
+}
 
-    Tp::MessagePartList partList;
+void MorseTextChannel::setMessageInboxRead(quint32 messageId)
+{
+    m_readInboxMaxId = qMax(m_readInboxMaxId, messageId);
 
-    Tp::MessagePart header;
-    header[QLatin1String("message-sender")]    = QDBusVariant(m_connection->selfHandle());
-    header[QLatin1String("message-sender-id")] = QDBusVariant(m_connection->selfID());
-    header[QLatin1String("message-type")]      = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
-    header[QLatin1String("delivery-status")]   = QDBusVariant(Tp::DeliveryStatusRead);
-    header[QLatin1String("delivery-token")]    = QDBusVariant(token);
-    partList << header;
+    // Messages are read up to the given id, so take the whole range at once
+    QStringList tokens;
+    QMap<quint32, QString>::iterator it = m_pendingMessageTokens.begin();
+    while ((it != m_pendingMessageTokens.end()) && (it.key() <= messageId)) {
+        tokens.append(it.value());
+        it = m_pendingMessageTokens.erase(it);
+    }
 
-    addReceivedMessage(partList);
+    if (tokens.isEmpty()) {
+        return;
+    }
+
+#if TP_QT_VERSION >= TP_QT_VERSION_CHECK(0, 9, 8)
+    Tp::DBusError error;
+    m_acknowledgingReadMessages = true;
+    acknowledgePendingMessages(tokens, &error);
+    m_acknowledgingReadMessages = false;
+#endif
 }
 
-void MorseTextChannel::setResolvedMessageId(Telegram::Peer peer, quint64 messageRandomId, quint32 messageId)
+void MorseTextChannel::setMessageOutboxRead(quint32 messageId)
 {
-    if (m_targetPeer != peer) {
+    if (messageId <= m_readOutboxMaxId) {
+        // Reported already
         return;
     }
+    m_readOutboxMaxId = messageId;
 
-    int index = m_sentMessageIds.indexOf(SentMessageId(messageRandomId));
-    if (index < 0) {
+    const QVector<quint64> randomIds = m_sentMessages.takeMessagesUpTo(messageId);
+    if (randomIds.isEmpty()) {
+        // The messages are sent from another session (or already forgotten),
+        // so there is no token known to the client to report
         return;
     }
 
-    m_sentMessageIds[index].id = messageId;
+    // Telepathy delivery reports have a single token, so report every message
+    Tp::MessagePart header = m_readReportHeader;
+    for (const quint64 randomId : randomIds) {
+        header[c_deliveryTokenKey] = QDBusVariant(QString::number(randomId));
+        addReceivedMessage(Tp::MessagePartList() << header);
+    }
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted, randomIds.count());
+    MorseMetrics::increment(MorseMetrics::MessageReceivedSignals, randomIds.count());
+}
+
+void MorseTextChannel::setResolvedMessageId(quint64 messageRandomId, quint32 messageId)
+{
+    if (!m_sentMessages.setMessageId(messageRandomId, messageId)) {
+        return;
+    }
 
     const QString token = QString::number(messageRandomId);
 
     Tp::MessagePartList partList;
 
     Tp::MessagePart header;
-    header[QLatin1String("message-sender")]    = QDBusVariant(m_targetHandle);
-    header[QLatin1String("message-sender-id")] = QDBusVariant(m_targetPeer.toString());
-    header[QLatin1String("message-type")]      = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
-    header[QLatin1String("delivery-status")]   = QDBusVariant(Tp::DeliveryStatusAccepted);
-    header[QLatin1String("delivery-token")]    = QDBusVariant(token);
+    header[c_messageSenderKey]   = QDBusVariant(m_targetHandle);
+    header[c_messageSenderIdKey] = QDBusVariant(m_targetPeer.toString());
+    header[c_messageTypeKey]     = QDBusVariant(Tp::ChannelTextMessageTypeDeliveryReport);
+    header[c_deliveryStatusKey]  = QDBusVariant(Tp::DeliveryStatusAccepted);
+    header[c_deliveryTokenKey]   = QDBusVariant(token);
     partList << header;
 
     addReceivedMessage(partList);
+    MorseMetrics::increment(MorseMetrics::DBusSignalsEmitted);
+    MorseMetrics::increment(MorseMetrics::MessageReceivedSignals);
 }
 
 void MorseTextChannel::reactivateLocalTyping()
@@ -20,12 +20,17 @@
 #ifndef MORSE_TEXTCHANNEL_HPP
 #define MORSE_TEXTCHANNEL_HPP
 
+#include <QMap>
+#include <QMultiHash>
 #include <QPointer>
+#include <QSet>
 
 #include <TelegramQt/TelegramNamespace>
 
 #include <TelepathyQt/BaseChannel>
 
+#include "sentmessagetracker.hpp"
+
 class QTimer;
 
 class CTelegramCore;
@@ -46,23 +51,6 @@ class MessagingApi;
 
 typedef Tp::SharedPtr<MorseTextChannel> MorseTextChannelPtr;
 
-struct SentMessageId
-{
-    SentMessageId(quint64 random = 0, quint32 actualId = 0) :
-        randomId(random),
-        id(actualId)
-    {
-    }
-
-    bool operator==(const SentMessageId &info) const
-    {
-        return randomId == info.randomId && id == info.id;
-    }
-
-    quint64 randomId;
-    quint32 id;
-};
-
 class MorseTextChannel : public Tp::BaseChannelTextType
 {
     Q_OBJECT
@@ -75,21 +63,27 @@ public:
     void messageAcknowledgedCallback(const QString &messageId);
 
 public slots:
-    void onMessageActionChanged(const Telegram::Peer &peer, quint32 userId, TelegramNamespace::MessageAction action);
     void setMessageAction(quint32 userId, TelegramNamespace::MessageAction action);
+    void addMessages(const QVector<Telegram::Message> &messages);
     void onMessageReceived(const Telegram::Message &message);
-    void updateChatParticipants(const Tp::UIntList &handles);
+    void addChatParticipants(const Tp::UIntList &addedHandles);
 
-    void onChatDetailsChanged(quint32 chatId, const Tp::UIntList &handles);
+    void refreshChatInfo();
+    void setResolvedMessageId(quint64 messageRandomId, quint32 messageId);
+    void setMessageInboxRead(quint32 messageId);
+    void setMessageOutboxRead(quint32 messageId);
+    void onMediaFileRequestFinished(const QString &uniqueId);
 
 protected slots:
-    void setMessageInboxRead(Telegram::Peer peer, quint32 messageId);
-    void setMessageOutboxRead(Telegram::Peer peer, quint32 messageId);
-    void setResolvedMessageId(Telegram::Peer peer, quint64 messageRandomId, quint32 messageId);
     void reactivateLocalTyping();
 
 protected:
     void setChatState(uint state, Tp::DBusError *error);
+    QString requestMediaFile(const Telegram::Message &message);
+    bool addMediaFilePart(Tp::MessagePartList *body, const Telegram::MessageMediaInfo &info);
+    void deliverHeldMessages();
+    void commitParticipants();
+    void updateMessageHeaders();
 
 private:
     MorseTextChannel(MorseConnection *morseConnection, Tp::BaseChannel *baseChannel);
@@ -111,7 +105,25 @@ private:
     Tp::BaseChannelRoomInterfacePtr m_roomIface;
     Tp::BaseChannelRoomConfigInterfacePtr m_roomConfigIface;
 
-    QVector<SentMessageId> m_sentMessageIds;
+    MorseSentMessageTracker m_sentMessages;
+    QMap<quint32, QString> m_pendingMessageTokens; // Message id to token of the received messages
+    bool m_acknowledgingReadMessages = false;
+
+    // Received messages held behind a media message until its file is downloaded
+    QMap<quint32, Telegram::Message> m_heldMessages; // Message id to message, delivered in order
+    QSet<quint32> m_messagesWaitingForMedia;
+    QMultiHash<QString, quint32> m_mediaRequestMessages; // File unique id to message ids
+
+    // Cached state and prebuilt header parts for the received messages
+    bool m_broadcast = false;
+    quint32 m_readInboxMaxId = 0;
+    quint32 m_readOutboxMaxId = 0;
+    Tp::MessagePart m_incomingHeader;
+    Tp::MessagePart m_outgoingHeader;
+    Tp::MessagePart m_readReportHeader;
+
+    QSet<uint> m_participants; // Known members of the room
+    Tp::UIntList m_addedParticipants; // Members seen in the current batch
     QTimer *m_localTypingTimer;
 
 };
@@ -0,0 +1,167 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "tracing.hpp"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSocketNotifier>
+#include <QVector>
+
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const int c_tracingBufferCapacity = 16384;
+
+struct TraceEvent
+{
+    const char *name; // Literals only
+    qint64 begin;
+    qint64 duration;
+};
+
+bool MorseTracing::s_enabled = false;
+
+static QElapsedTimer tracingClock;
+static QVector<TraceEvent> tracingBuffer; // Ring buffer, allocated on enable
+static int tracingBufferHead = 0; // The next slot to write
+static int tracingBufferCount = 0;
+
+void MorseTracing::setEnabled(bool enabled)
+{
+    if (enabled) {
+        if (tracingBuffer.isEmpty()) {
+            tracingBuffer.resize(c_tracingBufferCapacity);
+        }
+        if (!tracingClock.isValid()) {
+            tracingClock.start();
+        }
+    }
+    s_enabled = enabled;
+}
+
+qint64 MorseTracing::timestamp()
+{
+    return tracingClock.nsecsElapsed() / 1000;
+}
+
+void MorseTracing::addSpan(const char *name, qint64 begin, qint64 end)
+{
+    if (tracingBuffer.isEmpty()) {
+        return;
+    }
+    TraceEvent &event = tracingBuffer[tracingBufferHead];
+    event.name = name;
+    event.begin = begin;
+    event.duration = end - begin;
+    tracingBufferHead = (tracingBufferHead + 1) % c_tracingBufferCapacity;
+    if (tracingBufferCount < c_tracingBufferCapacity) {
+        ++tracingBufferCount;
+    }
+}
+
+void MorseTracing::clear()
+{
+    tracingBufferHead = 0;
+    tracingBufferCount = 0;
+}
+
+QByteArray MorseTracing::toChromeTraceJson()
+{
+    const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+
+    QByteArray result;
+    result.reserve(tracingBufferCount * 80 + 32);
+    result.append("{\"traceEvents\":[");
+
+    // Oldest first
+    const int first = (tracingBufferHead - tracingBufferCount + c_tracingBufferCapacity) % c_tracingBufferCapacity;
+    for (int i = 0; i < tracingBufferCount; ++i) {
+        const TraceEvent &event = tracingBuffer.at((first + i) % c_tracingBufferCapacity);
+        if (i) {
+            result.append(',');
+        }
+        // The span names are C++ identifiers, no escaping needed
+        result.append("{\"name\":\"");
+        result.append(event.name);
+        result.append("\",\"ph\":\"X\",\"ts\":");
+        result.append(QByteArray::number(event.begin));
+        result.append(",\"dur\":");
+        result.append(QByteArray::number(event.duration));
+        result.append(",\"pid\":");
+        result.append(pid);
+        result.append(",\"tid\":1}");
+    }
+
+    result.append("],\"displayTimeUnit\":\"ms\"}");
+    return result;
+}
+
+static int terminationSignalFds[2];
+
+static void handleTerminationSignal(int)
+{
+    // Only async-signal-safe calls here, the event loop is woken up by the socket notifier
+    const char byte = 1;
+    const ssize_t written = ::write(terminationSignalFds[0], &byte, sizeof(byte));
+    Q_UNUSED(written)
+}
+
+/* Quit the event loop on SIGTERM and SIGINT, so the application exits normally */
+static bool quitOnTerminationSignals(QCoreApplication *app)
+{
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, terminationSignalFds)) {
+        return false;
+    }
+    QSocketNotifier *notifier = new QSocketNotifier(terminationSignalFds[1], QSocketNotifier::Read, app);
+    QObject::connect(notifier, &QSocketNotifier::activated, app, &QCoreApplication::quit);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleTerminationSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    return !sigaction(SIGTERM, &action, nullptr) && !sigaction(SIGINT, &action, nullptr);
+}
+
+/**
+ * Enable the tracing and write the trace to \a fileName on the application exit,
+ * including the termination by SIGTERM or SIGINT.
+ */
+void MorseTracing::recordToFile(const QString &fileName)
+{
+    QCoreApplication *app = QCoreApplication::instance();
+    setEnabled(true);
+
+    if (!quitOnTerminationSignals(app)) {
+        qWarning() << "Unable to handle the termination signals, the trace is written on a normal exit only";
+    }
+    QObject::connect(app, &QCoreApplication::aboutToQuit, [fileName]() {
+        QFile traceFile(fileName);
+        if (traceFile.open(QIODevice::WriteOnly)) {
+            traceFile.write(toChromeTraceJson());
+        } else {
+            qWarning() << "Unable to write the trace file" << fileName;
+        }
+    });
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of the telepathy-morse connection manager.
+    Copyright (C) 2016 Alexandr Akulich <akulichalexander@gmail.com>
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MORSE_TRACING_HPP
+#define MORSE_TRACING_HPP
+
+#include <QByteArray>
+#include <QString>
+
+/**
+ * Scoped tracing spans of the hot paths.
+ *
+ * The completed spans are written to a fixed size ring buffer (the oldest
+ * are overwritten) which can be dumped in the Chrome trace event format and
+ * loaded into chrome://tracing or Perfetto. Tracing is disabled by default.
+ * A span reads the global flag once, on construction; a disabled span does no
+ * clock work and its destructor only tests the span's own name pointer.
+ * The spans are recorded from the main thread only.
+ */
+class MorseTracing
+{
+public:
+    static bool isEnabled() { return s_enabled; }
+    static void setEnabled(bool enabled);
+
+    static qint64 timestamp(); // In microseconds
+    static void addSpan(const char *name, qint64 begin, qint64 end);
+    static void clear();
+
+    static QByteArray toChromeTraceJson();
+    static void recordToFile(const QString &fileName);
+
+private:
+    static bool s_enabled;
+};
+
+class MorseTraceSpan
+{
+public:
+    explicit MorseTraceSpan(const char *name)
+    {
+        if (Q_LIKELY(!MorseTracing::isEnabled())) {
+            m_name = nullptr;
+            return;
+        }
+        m_name = name;
+        m_begin = MorseTracing::timestamp();
+    }
+
+    ~MorseTraceSpan()
+    {
+        if (Q_UNLIKELY(m_name)) {
+            MorseTracing::addSpan(m_name, m_begin, MorseTracing::timestamp());
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(MorseTraceSpan)
+
+    const char *m_name;
+    qint64 m_begin;
+};
+
+#define MORSE_TRACE_CONCAT_IMPL(a, b) a##b
+#define MORSE_TRACE_CONCAT(a, b) MORSE_TRACE_CONCAT_IMPL(a, b)
+#define MORSE_TRACE_SCOPE(name) MorseTraceSpan MORSE_TRACE_CONCAT(morseTraceSpan, __LINE__)(name)
+
+#endif // MORSE_TRACING_HPP